@@ -0,0 +1,191 @@
+#include "pch.h"
+#include "ConcurrencyLimiter.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+
+namespace {
+    // Weight of a new sample in the smoothed latency.
+    const double kSmoothing = 0.1;
+}
+
+ConcurrencyLimiter::ConcurrencyLimiter(const LimiterOptions& options)
+    : m_options(options),
+    m_limit((std::min)((std::max)(options.initialLimit, options.minLimit),
+        options.maxLimit)) {
+}
+
+void ConcurrencyLimiter::SetOptions(const LimiterOptions& options) {
+    {
+        std::lock_guard<std::mutex> lock(m_lock);
+        m_options = options;
+        m_limit = std::min<double>(std::max<double>(m_limit, options.minLimit),
+            options.maxLimit);
+    }
+    m_slotFree.notify_all();
+}
+
+bool ConcurrencyLimiter::Acquire() {
+    std::unique_lock<std::mutex> lock(m_lock);
+    if (m_inFlight < Limit()) {
+        ++m_inFlight;
+        return true;
+    }
+
+    if (m_waiting >= m_options.maxQueue) {
+        ++m_shed;
+        return false;
+    }
+
+    ++m_waiting;
+    auto slotFree = [this] { return m_inFlight < Limit(); };
+    bool admitted = true;
+    if (m_options.queueTimeoutMs) {
+        admitted = m_slotFree.wait_for(lock,
+            std::chrono::milliseconds(m_options.queueTimeoutMs), slotFree);
+    }
+    else {
+        m_slotFree.wait(lock, slotFree);
+    }
+    --m_waiting;
+
+    if (!admitted) {
+        ++m_shed;
+        return false;
+    }
+    ++m_inFlight;
+    return true;
+}
+
+void ConcurrencyLimiter::Release(ULONGLONG latencyUs, bool dropped) {
+    OverloadCallback callback;
+    bool overloaded = false;
+    bool grown = false;
+
+    {
+        std::lock_guard<std::mutex> lock(m_lock);
+        const DWORD previousLimit = Limit();
+        --m_inFlight;
+
+        const double latencyMs = latencyUs / 1000.0;
+        m_smoothedMs = m_hasSample
+            ? m_smoothedMs + (latencyMs - m_smoothedMs) * kSmoothing
+            : latencyMs;
+        m_hasSample = true;
+        const ULONGLONG now = ::GetTickCount64();
+        m_lastSample = now;
+
+        if (dropped || latencyMs > m_options.targetLatencyMs) {
+            // Requests that were in flight together usually miss the target
+            // together, so back off once per interval rather than per request.
+            if (now - m_lastDecrease >= m_options.targetLatencyMs) {
+                m_limit = std::max<double>(m_options.minLimit, m_limit * m_options.backoff);
+                m_lastDecrease = now;
+            }
+        }
+        else if ((m_inFlight + 1) * 2 >= previousLimit) {
+            // Only grow while the limit is what actually bounds the load.
+            m_limit = std::min<double>(m_options.maxLimit, m_limit + 1.0 / m_limit);
+        }
+        grown = Limit() > previousLimit;
+
+        if (UpdateOverloaded()) {
+            callback = m_onOverload;
+        }
+        overloaded = m_overloaded;
+    }
+
+    if (grown) {
+        m_slotFree.notify_all();
+    }
+    else {
+        m_slotFree.notify_one();
+    }
+
+    if (callback) {
+        callback(overloaded);
+    }
+}
+
+void ConcurrencyLimiter::SetOverloadCallback(OverloadCallback callback) {
+    std::lock_guard<std::mutex> lock(m_lock);
+    m_onOverload = std::move(callback);
+}
+
+void ConcurrencyLimiter::Refresh() {
+    OverloadCallback callback;
+    bool overloaded = false;
+
+    {
+        std::lock_guard<std::mutex> lock(m_lock);
+        const ULONGLONG now = ::GetTickCount64();
+        const ULONGLONG quiet = now - m_lastSample;
+        if (!m_hasSample || quiet < m_options.targetLatencyMs) {
+            return;
+        }
+
+        const double intervals =
+            static_cast<double>(quiet) / (std::max)(m_options.targetLatencyMs, 1UL);
+        m_smoothedMs *= std::pow(1.0 - kSmoothing, intervals);
+        m_lastSample = now;
+
+        if (UpdateOverloaded()) {
+            callback = m_onOverload;
+        }
+        overloaded = m_overloaded;
+    }
+
+    if (callback) {
+        callback(overloaded);
+    }
+}
+
+void ConcurrencyLimiter::ResetLatency() {
+    OverloadCallback callback;
+
+    {
+        std::lock_guard<std::mutex> lock(m_lock);
+        m_hasSample = false;
+        m_smoothedMs = 0;
+        if (m_overloaded) {
+            m_overloaded = false;
+            callback = m_onOverload;
+        }
+    }
+
+    if (callback) {
+        callback(false);
+    }
+}
+
+DWORD ConcurrencyLimiter::GetLimit() const {
+    std::lock_guard<std::mutex> lock(m_lock);
+    return Limit();
+}
+
+DWORD ConcurrencyLimiter::GetInFlight() const {
+    std::lock_guard<std::mutex> lock(m_lock);
+    return m_inFlight;
+}
+
+ULONGLONG ConcurrencyLimiter::GetShedCount() const {
+    std::lock_guard<std::mutex> lock(m_lock);
+    return m_shed;
+}
+
+bool ConcurrencyLimiter::IsOverloaded() const {
+    std::lock_guard<std::mutex> lock(m_lock);
+    return m_overloaded;
+}
+
+bool ConcurrencyLimiter::UpdateOverloaded() {
+    const bool overloaded = m_overloaded
+        ? m_smoothedMs >= m_options.targetLatencyMs
+        : m_smoothedMs > m_options.targetLatencyMs * m_options.overloadFactor;
+    if (overloaded == m_overloaded) {
+        return false;
+    }
+    m_overloaded = overloaded;
+    return true;
+}
@@ -0,0 +1,90 @@
+#ifndef CONCURRENCY_LIMITER_H_
+#define CONCURRENCY_LIMITER_H_
+
+#include <windows.h>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+
+struct LimiterOptions {
+    DWORD targetLatencyMs = 100;
+    DWORD initialLimit = 20;
+    DWORD minLimit = 1;
+    DWORD maxLimit = 1000;
+    // Multiplicative decrease applied when a request misses the target.
+    double backoff = 0.9;
+    // Requests allowed to wait for a slot. Zero sheds as soon as the limit
+    // is reached, and a zero timeout waits until a slot is free.
+    DWORD maxQueue = 0;
+    DWORD queueTimeoutMs = 0;
+    // Overloaded while the smoothed latency is above the target this many
+    // times, recovered once it falls back under the target.
+    double overloadFactor = 2.0;
+};
+
+// Adaptive limit on the number of requests a service processes at once.
+// The limit follows AIMD on the measured latency: it grows by about one
+// for every limit's worth of requests meeting the target and is cut by
+// |backoff| at most once per target interval when they don't.
+class ConcurrencyLimiter {
+public:
+    typedef std::function<void(bool overloaded)> OverloadCallback;
+
+    explicit ConcurrencyLimiter(const LimiterOptions& options = LimiterOptions());
+
+    ConcurrencyLimiter(const ConcurrencyLimiter& other) = delete;
+    ConcurrencyLimiter& operator=(const ConcurrencyLimiter& other) = delete;
+
+    // Replaces the options, keeping the current limit within the new bounds.
+    void SetOptions(const LimiterOptions& options);
+
+    // Admits a request, queueing it if the options allow. Returns false if
+    // the request was shed and must not be processed.
+    bool Acquire();
+
+    // Completes an admitted request. |dropped| marks a request that failed
+    // or timed out, which counts as a missed target.
+    void Release(ULONGLONG latencyUs, bool dropped = false);
+
+    // Called outside the lock whenever the overloaded state flips.
+    void SetOverloadCallback(OverloadCallback callback);
+
+    // Latency only moves when requests complete. Call periodically while
+    // overloaded: every target interval without a completed request counts
+    // as a request completing instantly, so the overload ends once the work
+    // stops coming in.
+    void Refresh();
+
+    // Forgets the measured latency and ends an overload.
+    void ResetLatency();
+
+    DWORD GetLimit() const;
+    DWORD GetInFlight() const;
+    ULONGLONG GetShedCount() const;
+    bool IsOverloaded() const;
+
+private:
+    DWORD Limit() const { return static_cast<DWORD>(m_limit); }
+    // Expects m_lock to be held. Returns whether the overloaded state flipped.
+    bool UpdateOverloaded();
+
+    LimiterOptions m_options;
+
+    mutable std::mutex m_lock;
+    std::condition_variable m_slotFree;
+
+    double m_limit;
+    DWORD m_inFlight = 0;
+    DWORD m_waiting = 0;
+    ULONGLONG m_shed = 0;
+    ULONGLONG m_lastDecrease = 0;
+
+    bool m_hasSample = false;
+    double m_smoothedMs = 0;
+    ULONGLONG m_lastSample = 0;
+    bool m_overloaded = false;
+
+    OverloadCallback m_onOverload;
+};
+
+#endif // CONCURRENCY_LIMITER_H_
@@ -0,0 +1,309 @@
+#include "pch.h"
+#include "ControlTrace.h"
+#include "Service_Base.h"
+#include "ServiceDriver.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <mutex>
+#include <thread>
+
+namespace {
+    typedef std::chrono::steady_clock Clock;
+
+    // File layout: magic, version, then one record per request made of
+    // varints (delta in us, control code, event type, payload size) followed
+    // by the payload bytes.
+    const BYTE kMagic[] = { 'S', 'V', 'C', 'T' };
+    const BYTE kVersion = 1;
+
+    // Request a thread is delivering during a replay.
+    struct PendingRequest {
+        DWORD ctrlCode;
+        Clock::time_point started;
+    };
+    thread_local const PendingRequest* t_request = nullptr;
+
+    ULONGLONG NowUs() {
+        return std::chrono::duration_cast<std::chrono::microseconds>(
+            Clock::now().time_since_epoch()).count();
+    }
+
+    void AppendVarint(std::vector<BYTE>& out, ULONGLONG value) {
+        while (value >= 0x80) {
+            out.push_back(static_cast<BYTE>(value | 0x80));
+            value >>= 7;
+        }
+        out.push_back(static_cast<BYTE>(value));
+    }
+
+    bool ReadVarint(const BYTE*& pos, const BYTE* end, ULONGLONG& value) {
+        value = 0;
+        for (int shift = 0; pos < end && shift < 64; shift += 7) {
+            const BYTE byte = *pos++;
+            value |= static_cast<ULONGLONG>(byte & 0x7F) << shift;
+            if (!(byte & 0x80)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Only the payloads ServiceBase understands are kept.
+    DWORD PayloadSize(DWORD ctrlCode, const void* evtData) {
+        if (evtData && ctrlCode == SERVICE_CONTROL_SESSIONCHANGE) {
+            return sizeof(WTSSESSION_NOTIFICATION);
+        }
+        return 0;
+    }
+
+    std::wstring ActivationPath(const std::wstring& path) {
+        SYSTEMTIME time;
+        ::GetLocalTime(&time);
+
+        wchar_t suffix[64];
+        swprintf_s(suffix, L"-%04u%02u%02u-%02u%02u%02u-%03u-%lu",
+            time.wYear, time.wMonth, time.wDay, time.wHour, time.wMinute,
+            time.wSecond, time.wMilliseconds, ::GetCurrentProcessId());
+
+        const size_t separator = path.find_last_of(L"\\/");
+        size_t extension = path.rfind(L'.');
+        if (extension == std::wstring::npos ||
+            (separator != std::wstring::npos && extension < separator)) {
+            extension = path.size();
+        }
+        return path.substr(0, extension) + suffix + path.substr(extension);
+    }
+
+    bool WriteAll(HANDLE file, const void* data, DWORD size) {
+        DWORD written = 0;
+        return ::WriteFile(file, data, size, &written, nullptr) && written == size;
+    }
+}
+
+ControlRecorder::~ControlRecorder() {
+    Close();
+}
+
+bool ControlRecorder::Open(const std::wstring& path) {
+    std::lock_guard<std::mutex> lock(m_lock);
+    if (m_file != INVALID_HANDLE_VALUE) {
+        return false;
+    }
+
+    const std::wstring tracePath = ActivationPath(path);
+    HANDLE file = ::CreateFileW(tracePath.c_str(), GENERIC_WRITE, FILE_SHARE_READ,
+        nullptr, CREATE_NEW, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE) {
+        printf("Couldn't create control trace: %d\n", ::GetLastError());
+        return false;
+    }
+
+    if (!WriteAll(file, kMagic, sizeof(kMagic)) ||
+        !WriteAll(file, &kVersion, sizeof(kVersion))) {
+        printf("Couldn't write control trace: %d\n", ::GetLastError());
+        ::CloseHandle(file);
+        return false;
+    }
+
+    m_file = file;
+    m_path = tracePath;
+    m_lastUs = NowUs();
+    return true;
+}
+
+void ControlRecorder::Close() {
+    std::lock_guard<std::mutex> lock(m_lock);
+    if (m_file != INVALID_HANDLE_VALUE) {
+        ::CloseHandle(m_file);
+        m_file = INVALID_HANDLE_VALUE;
+    }
+}
+
+void ControlRecorder::Record(DWORD ctrlCode, DWORD evtType, const void* evtData) {
+    const ULONGLONG now = NowUs();
+    const DWORD payloadSize = PayloadSize(ctrlCode, evtData);
+
+    std::lock_guard<std::mutex> lock(m_lock);
+    if (m_file == INVALID_HANDLE_VALUE) {
+        return;
+    }
+
+    std::vector<BYTE> record;
+    record.reserve(32 + payloadSize);
+    AppendVarint(record, now > m_lastUs ? now - m_lastUs : 0);
+    AppendVarint(record, ctrlCode);
+    AppendVarint(record, evtType);
+    AppendVarint(record, payloadSize);
+    if (payloadSize) {
+        const BYTE* payload = static_cast<const BYTE*>(evtData);
+        record.insert(record.end(), payload, payload + payloadSize);
+    }
+    m_lastUs = now > m_lastUs ? now : m_lastUs;
+
+    if (!WriteAll(m_file, record.data(), static_cast<DWORD>(record.size()))) {
+        printf("Couldn't write control trace: %d\n", ::GetLastError());
+    }
+}
+
+bool ControlReplayer::Load(const std::wstring& path) {
+    m_events.clear();
+
+    HANDLE file = ::CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE,
+        nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE) {
+        printf("Couldn't open control trace: %d\n", ::GetLastError());
+        return false;
+    }
+
+    LARGE_INTEGER size = {};
+    if (!::GetFileSizeEx(file, &size) || size.HighPart != 0) {
+        printf("Couldn't get control trace size: %d\n", ::GetLastError());
+        ::CloseHandle(file);
+        return false;
+    }
+
+    std::vector<BYTE> content(size.LowPart);
+    DWORD read = 0;
+    if (!content.empty() &&
+        !::ReadFile(file, content.data(), size.LowPart, &read, nullptr)) {
+        printf("Couldn't read control trace: %d\n", ::GetLastError());
+        ::CloseHandle(file);
+        return false;
+    }
+    ::CloseHandle(file);
+    content.resize(read);
+
+    if (content.size() < sizeof(kMagic) + 1 ||
+        memcmp(content.data(), kMagic, sizeof(kMagic)) != 0 ||
+        content[sizeof(kMagic)] != kVersion) {
+        printf("Invalid control trace\n");
+        return false;
+    }
+
+    const BYTE* pos = content.data() + sizeof(kMagic) + 1;
+    const BYTE* end = content.data() + content.size();
+    ULONGLONG offset = 0;
+
+    while (pos < end) {
+        ULONGLONG delta, ctrlCode, evtType, payloadSize;
+        if (!ReadVarint(pos, end, delta) || !ReadVarint(pos, end, ctrlCode) ||
+            !ReadVarint(pos, end, evtType) || !ReadVarint(pos, end, payloadSize) ||
+            payloadSize > static_cast<ULONGLONG>(end - pos)) {
+            // A truncated record at the end is expected after a crash.
+            printf("Control trace truncated after %zu events\n", m_events.size());
+            break;
+        }
+
+        offset += delta;
+        ControlEvent event = { offset, static_cast<DWORD>(ctrlCode),
+            static_cast<DWORD>(evtType),
+            std::vector<BYTE>(pos, pos + payloadSize) };
+        pos += payloadSize;
+        m_events.push_back(std::move(event));
+    }
+
+    return true;
+}
+
+bool ControlReplayer::Replay(ServiceBase& service, bool realTime,
+    std::vector<ReplayResult>& results,
+    std::vector<ReplayTransition>* transitions) const {
+    if (m_events.empty()) {
+        printf("Control trace is empty\n");
+        return false;
+    }
+
+    std::mutex resultsLock;
+    ServiceDriver driver(service);
+
+    // Set while a start hasn't left SERVICE_START_PENDING yet.
+    std::mutex startLock;
+    std::condition_variable startDone;
+    bool starting = false;
+    auto finishStart = [&startLock, &startDone, &starting] {
+        {
+            std::lock_guard<std::mutex> lock(startLock);
+            starting = false;
+        }
+        startDone.notify_all();
+    };
+
+    driver.SetStatusObserver([&resultsLock, &finishStart, transitions](DWORD from, DWORD to,
+        DWORD /*errCode*/) {
+        if (from == to) {
+            return;
+        }
+        if (from == SERVICE_START_PENDING) {
+            finishStart();
+        }
+        if (transitions) {
+            const PendingRequest* request = t_request;
+            const ULONGLONG latency = request
+                ? std::chrono::duration_cast<std::chrono::microseconds>(
+                    Clock::now() - request->started).count()
+                : 0;
+            ReplayTransition transition = { request ? request->ctrlCode : 0,
+                from, to, latency };
+
+            std::lock_guard<std::mutex> lock(resultsLock);
+            transitions->push_back(transition);
+        }
+    });
+
+    auto record = [&](DWORD ctrlCode, DWORD evtType, Clock::time_point started) {
+        const ULONGLONG latency = std::chrono::duration_cast<std::chrono::microseconds>(
+            Clock::now() - started).count();
+        ReplayResult result = { ctrlCode, evtType,
+            service.GetState(), latency };
+
+        std::lock_guard<std::mutex> lock(resultsLock);
+        results.push_back(result);
+    };
+
+    std::thread starter;
+    const Clock::time_point begin = Clock::now();
+
+    for (const ControlEvent& event : m_events) {
+        if (realTime) {
+            std::this_thread::sleep_until(begin + std::chrono::microseconds(event.offsetUs));
+        }
+
+        const Clock::time_point started = Clock::now();
+        if (event.ctrlCode == ControlRecorder::kStartCode) {
+            if (starter.joinable()) {
+                starter.join();
+            }
+            starting = true;
+            starter = std::thread([&driver, &record, &finishStart, started] {
+                const PendingRequest request = { ControlRecorder::kStartCode, started };
+                t_request = &request;
+                driver.Start(0, nullptr);
+                t_request = nullptr;
+                // Also covers a start ignored because the service runs.
+                finishStart();
+                record(ControlRecorder::kStartCode, 0, started);
+            });
+
+            // The SCM accepts no controls until the service leaves
+            // SERVICE_START_PENDING, so a later stop can't overtake the start.
+            std::unique_lock<std::mutex> lock(startLock);
+            startDone.wait(lock, [&starting] { return !starting; });
+            continue;
+        }
+
+        void* payload = event.payload.empty() ? nullptr
+            : const_cast<BYTE*>(event.payload.data());
+        const PendingRequest request = { event.ctrlCode, started };
+        t_request = &request;
+        driver.Control(event.ctrlCode, event.evtType, payload);
+        t_request = nullptr;
+        record(event.ctrlCode, event.evtType, started);
+    }
+
+    if (starter.joinable()) {
+        starter.join();
+    }
+    return true;
+}
@@ -0,0 +1,94 @@
+#ifndef CONTROL_TRACE_H_
+#define CONTROL_TRACE_H_
+
+#include <windows.h>
+#include <mutex>
+#include <string>
+#include <vector>
+
+class ServiceBase;
+
+// Control request as stored in a trace. |offsetUs| is the time since the
+// recording was opened.
+struct ControlEvent {
+    ULONGLONG offsetUs;
+    DWORD ctrlCode;
+    DWORD evtType;
+    std::vector<BYTE> payload;
+};
+
+// Outcome of one replayed control request.
+struct ReplayResult {
+    DWORD ctrlCode;
+    DWORD evtType;
+    // Service state once the request was handled.
+    DWORD state;
+    ULONGLONG latencyUs;
+};
+
+// State reported by the service while a trace was replayed.
+struct ReplayTransition {
+    // Request being handled when the state was reported. kStartCode for the
+    // start request and zero for changes the service made by itself, such
+    // as an idle stop.
+    DWORD ctrlCode;
+    DWORD from;
+    DWORD to;
+    // Time since the request was delivered, zero without a request.
+    ULONGLONG latencyUs;
+};
+
+// Writes every control request delivered to a service into a compact
+// binary trace. Records are written as they arrive so the tail of the
+// trace survives a crash.
+class ControlRecorder {
+public:
+    // Pseudo control code recorded when the SCM starts the service.
+    static const DWORD kStartCode = 0xFFFFFFFF;
+
+    ControlRecorder() {}
+    ~ControlRecorder();
+
+    ControlRecorder(const ControlRecorder& other) = delete;
+    ControlRecorder& operator=(const ControlRecorder& other) = delete;
+
+    // Creates a new trace for this activation of the service. The local time
+    // and the process id are inserted before the extension of |path|, so
+    // controls.svct becomes controls-20260101-120000-000-1234.svct and the
+    // traces of earlier activations are kept.
+    bool Open(const std::wstring& path);
+    void Close();
+    bool IsOpen() const { return m_file != INVALID_HANDLE_VALUE; }
+    // Path of the trace last opened.
+    const std::wstring& GetPath() const { return m_path; }
+
+    void Record(DWORD ctrlCode, DWORD evtType, const void* evtData);
+
+private:
+    std::mutex m_lock;
+    HANDLE m_file = INVALID_HANDLE_VALUE;
+    std::wstring m_path;
+    ULONGLONG m_lastUs = 0;
+};
+
+// Drives a recorded trace against a service through its control handler,
+// either with the recorded timing or as fast as possible.
+class ControlReplayer {
+public:
+    bool Load(const std::wstring& path);
+
+    const std::vector<ControlEvent>& GetEvents() const { return m_events; }
+
+    // Like the SCM, the start request runs on its own thread while the other
+    // requests are delivered from the calling thread, once the service has
+    // left SERVICE_START_PENDING. |transitions| receives the state changes
+    // reported meanwhile, in order.
+    bool Replay(ServiceBase& service, bool realTime,
+        std::vector<ReplayResult>& results,
+        std::vector<ReplayTransition>* transitions = nullptr) const;
+
+private:
+    std::vector<ControlEvent> m_events;
+};
+
+#endif // CONTROL_TRACE_H_
@@ -0,0 +1,25 @@
+#ifndef HANDOFF_H_
+#define HANDOFF_H_
+
+// windows.h includes winsock.h, which conflicts with winsock2.h, unless
+// WIN32_LEAN_AND_MEAN is defined. Include this header, or Service_Base.h,
+// before windows.h.
+#if defined(_WINSOCKAPI_) && !defined(_WINSOCK2API_)
+#error "Handoff.h must be included before windows.h or winsock.h"
+#endif
+
+#include <winsock2.h>
+#include <windows.h>
+#include <string>
+#include <vector>
+
+// Listening sockets and opaque state passed from the instance of a service
+// serving now to the standby instance replacing it. Service_Base.h only
+// declares it, include this header where OnHandoff() and OnTakeover() are
+// implemented.
+struct HandoffState {
+    std::vector<SOCKET> sockets;
+    std::string blob;
+};
+
+#endif // HANDOFF_H_
@@ -0,0 +1,345 @@
+#include "pch.h"
+#include "HandoffChannel.h"
+
+#include <sddl.h>
+#include <cstdio>
+
+#pragma comment(lib, "Ws2_32.lib")
+
+namespace {
+    struct MessageHeader {
+        DWORD type;
+        DWORD size;
+    };
+
+    // Upper bound for a message, so a broken peer can't make us allocate
+    // arbitrary amounts of memory.
+    const DWORD kMaxMessageSize = 64 * 1024 * 1024;
+
+    const ULONGLONG kNoDeadline = ~0ULL;
+
+    std::wstring PipeName(const std::wstring& serviceName) {
+        return L"\\\\.\\pipe\\ServiceHandoff-" + serviceName;
+    }
+
+    // TOKEN_USER of |process|, the SID is in the returned buffer.
+    bool GetProcessUser(HANDLE process, std::vector<BYTE>& tokenUser) {
+        HANDLE token = nullptr;
+        if (!::OpenProcessToken(process, TOKEN_QUERY, &token)) {
+            return false;
+        }
+
+        DWORD size = 0;
+        ::GetTokenInformation(token, TokenUser, nullptr, 0, &size);
+        tokenUser.resize(size);
+        const bool ok = size != 0 &&
+            ::GetTokenInformation(token, TokenUser, tokenUser.data(), size, &size);
+        ::CloseHandle(token);
+        return ok;
+    }
+
+    PSID UserSid(std::vector<BYTE>& tokenUser) {
+        return reinterpret_cast<TOKEN_USER*>(tokenUser.data())->User.Sid;
+    }
+
+    // Protected DACL granting access to the account of this process only.
+    // Free the descriptor with LocalFree().
+    PSECURITY_DESCRIPTOR CreatePipeSecurity() {
+        std::vector<BYTE> tokenUser;
+        wchar_t* sid = nullptr;
+        if (!GetProcessUser(::GetCurrentProcess(), tokenUser) ||
+            !::ConvertSidToStringSidW(UserSid(tokenUser), &sid)) {
+            return nullptr;
+        }
+
+        const std::wstring sddl = std::wstring(L"D:P(A;;GA;;;") + sid + L")";
+        ::LocalFree(sid);
+
+        PSECURITY_DESCRIPTOR descriptor = nullptr;
+        if (!::ConvertStringSecurityDescriptorToSecurityDescriptorW(sddl.c_str(),
+            SDDL_REVISION_1, &descriptor, nullptr)) {
+            return nullptr;
+        }
+        return descriptor;
+    }
+}
+
+HandoffChannel::~HandoffChannel() {
+    Close();
+}
+
+bool HandoffChannel::Listen(const std::wstring& serviceName, bool firstInstance) {
+    Close();
+
+    PSECURITY_DESCRIPTOR descriptor = CreatePipeSecurity();
+    if (!descriptor) {
+        printf("Couldn't create handoff pipe security: %d\n", ::GetLastError());
+        return false;
+    }
+    SECURITY_ATTRIBUTES attributes = { sizeof(attributes), descriptor, FALSE };
+
+    m_pipe = ::CreateNamedPipeW(PipeName(serviceName).c_str(),
+        PIPE_ACCESS_DUPLEX | FILE_FLAG_OVERLAPPED |
+        (firstInstance ? FILE_FLAG_FIRST_PIPE_INSTANCE : 0),
+        PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT | PIPE_REJECT_REMOTE_CLIENTS,
+        PIPE_UNLIMITED_INSTANCES,
+        4096,
+        4096,
+        0,
+        &attributes);
+    ::LocalFree(descriptor);
+    if (m_pipe == INVALID_HANDLE_VALUE) {
+        printf("Couldn't create handoff pipe: %d\n", ::GetLastError());
+        return false;
+    }
+
+    m_listen.hEvent = ::CreateEventW(nullptr, TRUE, FALSE, nullptr);
+    if (!m_listen.hEvent) {
+        Close();
+        return false;
+    }
+
+    if (::ConnectNamedPipe(m_pipe, &m_listen) ||
+        ::GetLastError() == ERROR_PIPE_CONNECTED) {
+        ::SetEvent(m_listen.hEvent);
+    }
+    else if (::GetLastError() != ERROR_IO_PENDING) {
+        Close();
+        return false;
+    }
+    return true;
+}
+
+bool HandoffChannel::FinishAccept() {
+    // Also succeeds when the standby connected before ConnectNamedPipe(), as
+    // the overlapped operation was never started then.
+    DWORD transferred = 0;
+    const BOOL connected =
+        ::GetOverlappedResult(m_pipe, &m_listen, &transferred, FALSE);
+    ::CloseHandle(m_listen.hEvent);
+    m_listen = {};
+
+    if (!connected || !::GetNamedPipeClientProcessId(m_pipe, &m_peerPid) ||
+        !VerifyPeer()) {
+        Close();
+        return false;
+    }
+    return true;
+}
+
+bool HandoffChannel::Connect(const std::wstring& serviceName, DWORD timeoutMs) {
+    Close();
+
+    const std::wstring name = PipeName(serviceName);
+    if (!::WaitNamedPipeW(name.c_str(), timeoutMs)) {
+        printf("No instance to take over from: %d\n", ::GetLastError());
+        return false;
+    }
+
+    // The host only needs to identify us, not to act on our behalf.
+    m_pipe = ::CreateFileW(name.c_str(), GENERIC_READ | GENERIC_WRITE, 0,
+        nullptr, OPEN_EXISTING,
+        FILE_FLAG_OVERLAPPED | SECURITY_SQOS_PRESENT | SECURITY_IDENTIFICATION,
+        nullptr);
+    if (m_pipe == INVALID_HANDLE_VALUE) {
+        printf("Couldn't open handoff pipe: %d\n", ::GetLastError());
+        return false;
+    }
+
+    if (!::GetNamedPipeServerProcessId(m_pipe, &m_peerPid) || !VerifyPeer()) {
+        Close();
+        return false;
+    }
+    return true;
+}
+
+bool HandoffChannel::Send(MessageType type, const std::string& payload,
+    DWORD timeoutMs) {
+    if (!IsOpen() || payload.size() > kMaxMessageSize) {
+        return false;
+    }
+
+    const ULONGLONG deadline =
+        timeoutMs == INFINITE ? kNoDeadline : ::GetTickCount64() + timeoutMs;
+    MessageHeader header = { type, static_cast<DWORD>(payload.size()) };
+    return Transfer(true, &header, sizeof(header), deadline) &&
+        (payload.empty() || Transfer(true, const_cast<char*>(payload.data()),
+            header.size, deadline));
+}
+
+bool HandoffChannel::SendValue(MessageType type, DWORD value, DWORD timeoutMs) {
+    return Send(type, std::string(reinterpret_cast<const char*>(&value), sizeof(value)),
+        timeoutMs);
+}
+
+bool HandoffChannel::Receive(MessageType& type, std::string& payload,
+    DWORD timeoutMs) {
+    if (!IsOpen()) {
+        return false;
+    }
+
+    const ULONGLONG deadline =
+        timeoutMs == INFINITE ? kNoDeadline : ::GetTickCount64() + timeoutMs;
+    MessageHeader header = {};
+    if (!Transfer(false, &header, sizeof(header), deadline) ||
+        header.size > kMaxMessageSize) {
+        return false;
+    }
+
+    type = static_cast<MessageType>(header.type);
+    payload.assign(header.size, '\0');
+    return header.size == 0 || Transfer(false, &payload[0], header.size, deadline);
+}
+
+// static
+bool HandoffChannel::EncodeState(const HandoffState& state, DWORD targetPid,
+    std::string& payload) {
+    const DWORD count = static_cast<DWORD>(state.sockets.size());
+
+    payload.assign(sizeof(count) + count * sizeof(WSAPROTOCOL_INFOW), '\0');
+    memcpy(&payload[0], &count, sizeof(count));
+
+    WSAPROTOCOL_INFOW* infos =
+        reinterpret_cast<WSAPROTOCOL_INFOW*>(&payload[sizeof(count)]);
+    for (DWORD i = 0; i < count; i++) {
+        if (::WSADuplicateSocketW(state.sockets[i], targetPid, &infos[i]) != 0) {
+            printf("Couldn't duplicate socket for handoff: %d\n", ::WSAGetLastError());
+            return false;
+        }
+    }
+    payload += state.blob;
+    return true;
+}
+
+// static
+bool HandoffChannel::DecodeState(const std::string& payload, HandoffState& state) {
+    DWORD count = 0;
+    if (payload.size() < sizeof(count)) {
+        return false;
+    }
+    memcpy(&count, payload.data(), sizeof(count));
+
+    const size_t infoSize = static_cast<size_t>(count) * sizeof(WSAPROTOCOL_INFOW);
+    if (payload.size() - sizeof(count) < infoSize) {
+        return false;
+    }
+
+    // The received sockets outlive the channel, so Winsock stays initialized.
+    WSADATA wsaData;
+    if (::WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) {
+        return false;
+    }
+
+    state.sockets.clear();
+    for (DWORD i = 0; i < count; i++) {
+        WSAPROTOCOL_INFOW info;
+        memcpy(&info, &payload[sizeof(count) + i * sizeof(info)], sizeof(info));
+
+        SOCKET socket = ::WSASocketW(FROM_PROTOCOL_INFO, FROM_PROTOCOL_INFO,
+            FROM_PROTOCOL_INFO, &info, 0, WSA_FLAG_OVERLAPPED);
+        if (socket == INVALID_SOCKET) {
+            printf("Couldn't open handed off socket: %d\n", ::WSAGetLastError());
+            for (SOCKET opened : state.sockets) {
+                ::closesocket(opened);
+            }
+            state.sockets.clear();
+            return false;
+        }
+        state.sockets.push_back(socket);
+    }
+    state.blob = payload.substr(sizeof(count) + infoSize);
+    return true;
+}
+
+// static
+bool HandoffChannel::DecodeValue(const std::string& payload, DWORD& value) {
+    if (payload.size() != sizeof(value)) {
+        return false;
+    }
+    memcpy(&value, payload.data(), sizeof(value));
+    return true;
+}
+
+void HandoffChannel::Close() {
+    if (m_pipe != INVALID_HANDLE_VALUE) {
+        ::CancelIoEx(m_pipe, nullptr);
+        if (m_listen.hEvent) {
+            DWORD transferred = 0;
+            ::GetOverlappedResult(m_pipe, &m_listen, &transferred, TRUE);
+        }
+        ::CloseHandle(m_pipe);
+        m_pipe = INVALID_HANDLE_VALUE;
+    }
+    if (m_listen.hEvent) {
+        ::CloseHandle(m_listen.hEvent);
+        m_listen = {};
+    }
+    m_peerPid = 0;
+}
+
+bool HandoffChannel::VerifyPeer() {
+    std::vector<BYTE> ours;
+    std::vector<BYTE> theirs;
+    HANDLE peer = ::OpenProcess(PROCESS_QUERY_LIMITED_INFORMATION, FALSE, m_peerPid);
+    const bool same = peer &&
+        GetProcessUser(::GetCurrentProcess(), ours) &&
+        GetProcessUser(peer, theirs) &&
+        ::EqualSid(UserSid(ours), UserSid(theirs));
+    if (peer) {
+        ::CloseHandle(peer);
+    }
+
+    if (!same) {
+        printf("Handoff peer %lu doesn't run under the service account\n", m_peerPid);
+    }
+    return same;
+}
+
+bool HandoffChannel::Transfer(bool write, void* data, DWORD size, ULONGLONG deadline) {
+    OVERLAPPED overlapped = {};
+    overlapped.hEvent = ::CreateEventW(nullptr, TRUE, FALSE, nullptr);
+    if (!overlapped.hEvent) {
+        return false;
+    }
+
+    // Writes only wait for the pipe buffer, so only reads are cancelled.
+    HANDLE events[] = { overlapped.hEvent, m_cancel };
+    const DWORD eventCount = !write && m_cancel ? 2 : 1;
+
+    BYTE* pos = static_cast<BYTE*>(data);
+    bool ok = true;
+    while (ok && size) {
+        DWORD transferred = 0;
+        ::ResetEvent(overlapped.hEvent);
+
+        const BOOL started = write
+            ? ::WriteFile(m_pipe, pos, size, nullptr, &overlapped)
+            : ::ReadFile(m_pipe, pos, size, nullptr, &overlapped);
+        if (!started && ::GetLastError() != ERROR_IO_PENDING) {
+            ok = false;
+            break;
+        }
+
+        DWORD waitMs = INFINITE;
+        if (deadline != kNoDeadline) {
+            const ULONGLONG now = ::GetTickCount64();
+            waitMs = deadline > now ? static_cast<DWORD>(deadline - now) : 0;
+        }
+        if (::WaitForMultipleObjects(eventCount, events, FALSE, waitMs) != WAIT_OBJECT_0) {
+            ::CancelIoEx(m_pipe, &overlapped);
+            ::GetOverlappedResult(m_pipe, &overlapped, &transferred, TRUE);
+            ok = false;
+        }
+        else if (!::GetOverlappedResult(m_pipe, &overlapped, &transferred, FALSE) ||
+            transferred == 0) {
+            ok = false;
+        }
+        else {
+            pos += transferred;
+            size -= transferred;
+        }
+    }
+
+    ::CloseHandle(overlapped.hEvent);
+    return ok;
+}
@@ -0,0 +1,72 @@
+#ifndef HANDOFF_CHANNEL_H_
+#define HANDOFF_CHANNEL_H_
+
+#include "Handoff.h"
+
+// Local named pipe between the instance of a service started by the SCM,
+// the host, and a standby instance. The host keeps the channel to the
+// instance serving now to forward SCM controls to it and to relay the
+// handoff to the next standby. Only processes running under the account of
+// the host can open the pipe, and both ends check the account of the peer.
+class HandoffChannel {
+public:
+    enum MessageType : DWORD {
+        // HandoffState with the sockets duplicated for the receiver.
+        MessageState = 1,
+        MessageAck = 2,
+        // Control code forwarded to the instance serving.
+        MessageControl = 3,
+        // Asks the instance serving to export its state for the standby with
+        // the given process id.
+        MessageHandoff = 4,
+        MessageFailed = 5,
+    };
+
+    HandoffChannel() {}
+    ~HandoffChannel();
+
+    HandoffChannel(const HandoffChannel& other) = delete;
+    HandoffChannel& operator=(const HandoffChannel& other) = delete;
+
+    // Host side. Listen() creates a pipe instance and waits for a standby in
+    // the background. Set |firstInstance| unless the host already holds an
+    // instance of the pipe, so a pipe created by another process is never
+    // used. Once GetListenEvent() is signaled, FinishAccept() completes the
+    // connection and checks the account of the standby.
+    bool Listen(const std::wstring& serviceName, bool firstInstance);
+    HANDLE GetListenEvent() const { return m_listen.hEvent; }
+    bool FinishAccept();
+
+    // Standby side, checks the account of the host.
+    bool Connect(const std::wstring& serviceName, DWORD timeoutMs);
+
+    // Messages fail after |timeoutMs|, INFINITE waits until the pipe breaks.
+    // Receiving also fails once |cancelEvent| is set.
+    void SetCancelEvent(HANDLE cancelEvent) { m_cancel = cancelEvent; }
+
+    bool Send(MessageType type, const std::string& payload, DWORD timeoutMs);
+    bool SendValue(MessageType type, DWORD value, DWORD timeoutMs);
+    bool Receive(MessageType& type, std::string& payload, DWORD timeoutMs);
+
+    // Payload of a MessageState, with the sockets duplicated for |targetPid|.
+    static bool EncodeState(const HandoffState& state, DWORD targetPid,
+        std::string& payload);
+    // Opens the sockets of a state encoded for this process.
+    static bool DecodeState(const std::string& payload, HandoffState& state);
+    static bool DecodeValue(const std::string& payload, DWORD& value);
+
+    DWORD GetPeerPid() const { return m_peerPid; }
+    bool IsOpen() const { return m_pipe != INVALID_HANDLE_VALUE; }
+    void Close();
+
+private:
+    bool VerifyPeer();
+    bool Transfer(bool write, void* data, DWORD size, ULONGLONG deadline);
+
+    HANDLE m_pipe = INVALID_HANDLE_VALUE;
+    OVERLAPPED m_listen = {};
+    HANDLE m_cancel = nullptr;
+    DWORD m_peerPid = 0;
+};
+
+#endif // HANDOFF_CHANNEL_H_
@@ -1,11 +1,25 @@
 #include "pch.h"
 #include "Service_Base.h"
+#include "HandoffChannel.h"
 #include <string>
 #include <cassert>
 #include <iostream>
 
 ServiceBase* ServiceBase::m_service = nullptr;
 
+namespace {
+    // How long a standby waits for the host to accept it and send the state.
+    const DWORD kHandoffConnectTimeout = 30000;
+    // Limit for each step of a handoff and for forwarded controls.
+    const DWORD kHandoffTimeout = 10000;
+
+    // Delay before checking idleness again when a transition was running.
+    const DWORD kIdleRetryMs = 50;
+
+    // Interval of the overload checks while paused because of overload.
+    const DWORD kOverloadRecheckMs = 100;
+}
+
 ServiceBase::ServiceBase(const std::wstring& name,
     const std::wstring& displayName,
     DWORD dwStartType,
@@ -21,9 +35,11 @@ ServiceBase::ServiceBase(const std::wstring& name,
     m_depends(depends),
     m_account(account),
     m_password(PassWord),
+    m_dwAcceptedCmds(dwAcceptedCmds),
     m_svcStatusHandle(nullptr) {
 
-    m_svcStatus.dwControlsAccepted = dwAcceptedCmds;
+    // Nothing is accepted until OnStart() returns.
+    m_svcStatus.dwControlsAccepted = 0;
     m_svcStatus.dwServiceType = SERVICE_WIN32_OWN_PROCESS;
     m_svcStatus.dwCurrentState = SERVICE_START_PENDING;
     m_svcStatus.dwWin32ExitCode = NO_ERROR;
@@ -32,12 +48,75 @@ ServiceBase::ServiceBase(const std::wstring& name,
     m_svcStatus.dwWaitHint = 0;
 }
 
+ServiceBase::~ServiceBase() {
+    // Timer callbacks use the members declared after m_timers, which are
+    // destroyed before it.
+    m_timers.Stop();
+    StopHandoffListener();
+    if (m_workerProcess) {
+        ::CloseHandle(m_workerProcess);
+    }
+    if (m_handoffCancel) {
+        ::CloseHandle(m_handoffCancel);
+    }
+}
+
+void ServiceBase::AddTrigger(DWORD type, const GUID& subtype,
+    const std::wstring& data, DWORD action) {
+    ServiceTrigger trigger = { type, subtype, action, data };
+    m_triggers.push_back(trigger);
+}
+
+void ServiceBase::EnableOverloadPause() {
+    m_limiter.SetOverloadCallback([this](bool /*overloaded*/) {
+        RequestOverloadCheck(0);
+    });
+}
+
+void ServiceBase::NotifyActivity() {
+    m_lastActivity = ::GetTickCount64();
+}
+
+void ServiceBase::BeginActivity() {
+    ++m_activeCount;
+    NotifyActivity();
+}
+
+void ServiceBase::EndActivity() {
+    NotifyActivity();
+    --m_activeCount;
+}
+
+DWORD ServiceBase::GetState() const {
+    std::lock_guard<std::mutex> lock(m_statusLock);
+    return m_svcStatus.dwCurrentState;
+}
+
 void ServiceBase::SetStatus(DWORD dwState, DWORD dwErrCode, DWORD dwWait) {
+    std::lock_guard<std::mutex> lock(m_statusLock);
+    if (m_statusObserver) {
+        m_statusObserver(m_svcStatus.dwCurrentState, dwState, dwErrCode);
+    }
+    assert(IsLegalTransition(m_svcStatus.dwCurrentState, dwState, dwErrCode));
+
+    // The SCM expects the check point to grow while a pending operation
+    // makes progress and to be zero otherwise.
+    const bool pending = dwState == SERVICE_START_PENDING ||
+        dwState == SERVICE_STOP_PENDING ||
+        dwState == SERVICE_PAUSE_PENDING ||
+        dwState == SERVICE_CONTINUE_PENDING;
+    m_svcStatus.dwCheckPoint = pending ? m_svcStatus.dwCheckPoint + 1 : 0;
+
+    m_svcStatus.dwControlsAccepted =
+        dwState == SERVICE_START_PENDING ? 0 : m_dwAcceptedCmds;
     m_svcStatus.dwCurrentState = dwState;
     m_svcStatus.dwWin32ExitCode = dwErrCode;
     m_svcStatus.dwWaitHint = dwWait;
 
-    ::SetServiceStatus(m_svcStatusHandle, &m_svcStatus);
+    // No handle when the service is driven by a ServiceDriver.
+    if (m_svcStatusHandle) {
+        ::SetServiceStatus(m_svcStatusHandle, &m_svcStatus);
+    }
 }
 
 // static
@@ -51,12 +130,15 @@ void WINAPI ServiceBase::SvcMain(DWORD argc, TCHAR* argv[]) {
         return;
     }
 
+    m_service->m_recorder.Record(ControlRecorder::kStartCode, 0, nullptr);
     m_service->Start(argc, argv);
 }
 
 // static
 DWORD WINAPI ServiceBase::ServiceCtrlHandler(DWORD ctrlCode, DWORD evtType,
     void* evtData, void* /*context*/) {
+    m_service->m_recorder.Record(ctrlCode, evtType, evtData);
+
     switch (ctrlCode) {
     case SERVICE_CONTROL_STOP:
         m_service->Stop();
@@ -85,6 +167,114 @@ DWORD WINAPI ServiceBase::ServiceCtrlHandler(DWORD ctrlCode, DWORD evtType,
     return 0;
 }
 
+bool ServiceBase::RunStandby(DWORD argc, wchar_t* argv[]) {
+    m_service = this;
+
+    // Warm up while the instance serving now still serves.
+    OnStandby(argc, argv);
+
+    m_handoffCancel = ::CreateEventW(nullptr, TRUE, FALSE, nullptr);
+    m_host.reset(new HandoffChannel());
+
+    HandoffChannel::MessageType type;
+    std::string payload;
+    HandoffState state;
+    if (!m_handoffCancel ||
+        !m_host->Connect(GetName(), kHandoffConnectTimeout) ||
+        !m_host->Receive(type, payload, kHandoffConnectTimeout) ||
+        type != HandoffChannel::MessageState ||
+        !HandoffChannel::DecodeState(payload, state)) {
+        std::cout << "Couldn't receive handoff state\n";
+        return false;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(m_transitionLock);
+        if (!OnTakeover(state)) {
+            // The instance serving keeps serving once the pipe is closed.
+            std::cout << "Takeover failed\n";
+            for (SOCKET socket : state.sockets) {
+                ::closesocket(socket);
+            }
+            m_host->Close();
+            return false;
+        }
+        SetStatus(SERVICE_RUNNING);
+
+        if (m_idleTimeout) {
+            NotifyActivity();
+            ArmIdleTimer(m_idleTimeout);
+        }
+    }
+
+    if (!m_host->Send(HandoffChannel::MessageAck, std::string(), kHandoffTimeout)) {
+        Stop();
+        return false;
+    }
+
+    // Requests of the host: controls the SCM sent to it and handoffs to the
+    // next standby. Stop() ends the wait when this instance stops by itself.
+    m_host->SetCancelEvent(m_handoffCancel);
+    bool handedOff = false;
+    DWORD value = 0;
+    while (!handedOff && GetState() != SERVICE_STOPPED &&
+        m_host->Receive(type, payload, INFINITE) &&
+        HandoffChannel::DecodeValue(payload, value)) {
+        if (type == HandoffChannel::MessageControl) {
+            ServiceCtrlHandler(value, 0, nullptr, nullptr);
+            m_host->Send(HandoffChannel::MessageAck, std::string(), kHandoffTimeout);
+        }
+        else if (type == HandoffChannel::MessageHandoff) {
+            handedOff = ExportTo(value);
+        }
+    }
+
+    // Without the host nobody can stop this instance anymore.
+    Stop();
+    m_host->Close();
+    return true;
+}
+
+bool ServiceBase::ExportTo(DWORD standbyPid) {
+    std::string payload;
+    bool exported = false;
+    {
+        std::lock_guard<std::mutex> lock(m_transitionLock);
+        HandoffState state;
+        exported = GetState() == SERVICE_RUNNING && OnHandoff(state) &&
+            HandoffChannel::EncodeState(state, standbyPid, payload);
+    }
+    if (!exported) {
+        m_host->Send(HandoffChannel::MessageFailed, std::string(), kHandoffTimeout);
+        return false;
+    }
+
+    // Keep serving until the host confirms the standby took over. The host
+    // waits up to kHandoffTimeout for the standby before it answers.
+    HandoffChannel::MessageType reply;
+    std::string ignored;
+    if (!m_host->Send(HandoffChannel::MessageState, payload, kHandoffTimeout) ||
+        !m_host->Receive(reply, ignored, 2 * kHandoffTimeout) ||
+        reply != HandoffChannel::MessageAck) {
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(m_transitionLock);
+    const DWORD state = GetState();
+    if (state == SERVICE_STOPPED || state == SERVICE_STOP_PENDING) {
+        return true;
+    }
+
+    // The standby serves now and the host forwards to it, so this instance
+    // is done.
+    SetStatus(SERVICE_STOP_PENDING);
+    m_timers.Stop();
+    OnHandoffComplete();
+    SetStatus(SERVICE_STOPPED);
+    m_recorder.Close();
+    return true;
+}
+
 bool ServiceBase::RunInternal(ServiceBase* svc) {
     m_service = svc;
 
@@ -98,31 +288,500 @@ bool ServiceBase::RunInternal(ServiceBase* svc) {
     return ::StartServiceCtrlDispatcher(tableEntry) == TRUE;
 }
 
+// static
+bool ServiceBase::IsLegalTransition(DWORD from, DWORD to, DWORD errCode) {
+    // Re-reporting a state is always fine, and so is failing into
+    // SERVICE_STOPPED. A clean stop goes through SERVICE_STOP_PENDING unless
+    // the service never got past starting.
+    if (from == to || (to == SERVICE_STOPPED && errCode != NO_ERROR)) {
+        return true;
+    }
+    if (to == SERVICE_STOPPED) {
+        return from == SERVICE_START_PENDING || from == SERVICE_STOP_PENDING;
+    }
+
+    switch (from) {
+    case SERVICE_STOPPED:
+        return to == SERVICE_START_PENDING;
+    case SERVICE_START_PENDING:
+        return to == SERVICE_RUNNING || to == SERVICE_STOP_PENDING;
+    case SERVICE_RUNNING:
+        return to == SERVICE_PAUSE_PENDING || to == SERVICE_STOP_PENDING;
+    case SERVICE_PAUSE_PENDING:
+        return to == SERVICE_PAUSED || to == SERVICE_RUNNING ||
+            to == SERVICE_STOP_PENDING;
+    case SERVICE_PAUSED:
+        return to == SERVICE_CONTINUE_PENDING || to == SERVICE_STOP_PENDING;
+    case SERVICE_CONTINUE_PENDING:
+        return to == SERVICE_RUNNING || to == SERVICE_PAUSED ||
+            to == SERVICE_STOP_PENDING;
+    default:
+        return false;
+    }
+}
+
 void ServiceBase::Start(DWORD argc, TCHAR* argv[]) {
+    std::lock_guard<std::mutex> lock(m_transitionLock);
+
+    const DWORD state = GetState();
+    if (state != SERVICE_START_PENDING && state != SERVICE_STOPPED) {
+        return;
+    }
+
     SetStatus(SERVICE_START_PENDING);
     OnStart(argc, argv);
-    SetStatus(SERVICE_RUNNING);
+    // OnStart() may have reported a failure, or SERVICE_RUNNING, already.
+    const DWORD started = GetState();
+    if (started == SERVICE_STOPPED || started == SERVICE_STOP_PENDING) {
+        return;
+    }
+    if (started == SERVICE_START_PENDING) {
+        SetStatus(SERVICE_RUNNING);
+    }
+
+    if (m_idleTimeout) {
+        NotifyActivity();
+        ArmIdleTimer(m_idleTimeout);
+    }
+    if (m_handoffEnabled) {
+        StartHandoffListener();
+    }
 }
 
 void ServiceBase::Stop() {
+    std::lock_guard<std::mutex> lock(m_transitionLock);
+    StopLocked();
+}
+
+void ServiceBase::StopLocked() {
+    const DWORD state = GetState();
+    if (state == SERVICE_STOPPED || state == SERVICE_STOP_PENDING) {
+        return;
+    }
+
     SetStatus(SERVICE_STOP_PENDING);
-    OnStop();
+    m_overloadPaused = false;
+    StopHandoffListener();
+    m_timers.Stop();
+    if (m_handedOff) {
+        ForwardControl(SERVICE_CONTROL_STOP);
+        ReleaseWorker();
+    }
+    else {
+        OnStop();
+    }
     SetStatus(SERVICE_STOPPED);
+    m_recorder.Close();
 }
 
 void ServiceBase::Pause() {
+    std::lock_guard<std::mutex> lock(m_transitionLock);
+    if (m_overloadPaused) {
+        // Already reported as paused, the operator now owns the pause. The
+        // overload is over as far as the service is concerned, so it sees
+        // OnOverload(false) before the pause like any other.
+        m_overloadPaused = false;
+        OnOverload(false);
+        m_timers.Suspend();
+        if (m_handedOff) {
+            ForwardControl(SERVICE_CONTROL_PAUSE);
+        }
+        else {
+            OnPause();
+        }
+        return;
+    }
+    if (GetState() != SERVICE_RUNNING) {
+        return;
+    }
+
     SetStatus(SERVICE_PAUSE_PENDING);
-    OnPause();
+    m_timers.Suspend();
+    if (m_handedOff) {
+        ForwardControl(SERVICE_CONTROL_PAUSE);
+    }
+    else {
+        OnPause();
+    }
     SetStatus(SERVICE_PAUSED);
 }
 
 void ServiceBase::Continue() {
+    std::lock_guard<std::mutex> lock(m_transitionLock);
+    if (GetState() != SERVICE_PAUSED) {
+        return;
+    }
+
     SetStatus(SERVICE_CONTINUE_PENDING);
-    OnContinue();
+    // Latency measured before the pause would pause the service right away.
+    m_limiter.ResetLatency();
+    if (m_overloadPaused) {
+        // The operator ends the overload pause.
+        m_overloadPaused = false;
+        OnOverload(false);
+    }
+    else if (m_handedOff) {
+        ForwardControl(SERVICE_CONTROL_CONTINUE);
+    }
+    else {
+        OnContinue();
+    }
+    m_timers.Resume();
     SetStatus(SERVICE_RUNNING);
+
+    // Time spent paused doesn't count as idle.
+    if (m_idleTimeout && !m_handedOff) {
+        NotifyActivity();
+        ArmIdleTimer(m_idleTimeout);
+    }
 }
 
 void ServiceBase::Shutdown() {
-    OnShutdown();
+    std::lock_guard<std::mutex> lock(m_transitionLock);
+    const DWORD state = GetState();
+    if (state == SERVICE_STOPPED || state == SERVICE_STOP_PENDING) {
+        return;
+    }
+
+    SetStatus(SERVICE_STOP_PENDING);
+    m_overloadPaused = false;
+    StopHandoffListener();
+    m_timers.Stop();
+    if (m_handedOff) {
+        ForwardControl(SERVICE_CONTROL_SHUTDOWN);
+        ReleaseWorker();
+    }
+    else {
+        OnShutdown();
+    }
     SetStatus(SERVICE_STOPPED);
-}
\ No newline at end of file
+    m_recorder.Close();
+}
+
+void ServiceBase::StartHandoffListener() {
+    // A listener that ended with the service, see WorkerExited().
+    if (m_handoffThread.joinable()) {
+        m_handoffThread.join();
+    }
+
+    if (!m_handoffCancel) {
+        m_handoffCancel = ::CreateEventW(nullptr, TRUE, FALSE, nullptr);
+        if (!m_handoffCancel) {
+            std::cout << "Can't create handoff event\n";
+            return;
+        }
+    }
+    ::ResetEvent(m_handoffCancel);
+    m_handoffThread = std::thread(&ServiceBase::HandoffLoop, this);
+}
+
+void ServiceBase::StopHandoffListener() {
+    // Also ends the wait of a standby for requests of the host.
+    if (m_handoffCancel) {
+        ::SetEvent(m_handoffCancel);
+    }
+    if (m_handoffThread.joinable()) {
+        m_handoffThread.join();
+    }
+}
+
+void ServiceBase::HandoffLoop() {
+    for (;;) {
+        bool firstInstance = false;
+        {
+            std::lock_guard<std::mutex> workerLock(m_workerLock);
+            firstInstance = !m_worker || !m_worker->IsOpen();
+        }
+
+        std::unique_ptr<HandoffChannel> standby(new HandoffChannel());
+        standby->SetCancelEvent(m_handoffCancel);
+        if (!standby->Listen(GetName(), firstInstance)) {
+            return;
+        }
+
+        HANDLE events[] = {
+            standby->GetListenEvent(), m_handoffCancel, m_workerProcess };
+        const DWORD signaled = ::WaitForMultipleObjects(
+            m_workerProcess ? 3 : 2, events, FALSE, INFINITE);
+        if (signaled == WAIT_OBJECT_0 + 2) {
+            WorkerExited();
+            return;
+        }
+        if (signaled != WAIT_OBJECT_0) {
+            return;
+        }
+        if (!standby->FinishAccept()) {
+            continue;
+        }
+
+        if (!(m_handedOff ? RelayHandoff(standby) : HandOff(standby))) {
+            std::cout << "Handoff failed, keep serving\n";
+        }
+    }
+}
+
+bool ServiceBase::LockForHandoff(std::unique_lock<std::mutex>& lock) {
+    // Stop() holds the lock while it waits for the handoff thread to exit.
+    while (!lock.try_lock()) {
+        if (::WaitForSingleObject(m_handoffCancel, 10) == WAIT_OBJECT_0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool ServiceBase::HandOff(std::unique_ptr<HandoffChannel>& standby) {
+    std::string payload;
+    {
+        std::unique_lock<std::mutex> lock(m_transitionLock, std::defer_lock);
+        if (!LockForHandoff(lock)) {
+            return false;
+        }
+        HandoffState state;
+        if (GetState() != SERVICE_RUNNING || !OnHandoff(state) ||
+            !HandoffChannel::EncodeState(state, standby->GetPeerPid(), payload)) {
+            return false;
+        }
+    }
+
+    // Keep serving until the standby confirms it owns the sockets, so there
+    // is no gap in accepting requests. Controls aren't held up by a slow
+    // takeover, and a stop cancels it: the standby stops once the pipe
+    // closes.
+    HandoffChannel::MessageType reply;
+    std::string ignored;
+    if (!standby->Send(HandoffChannel::MessageState, payload, kHandoffTimeout) ||
+        !standby->Receive(reply, ignored, kHandoffTimeout) ||
+        reply != HandoffChannel::MessageAck) {
+        return false;
+    }
+
+    std::unique_lock<std::mutex> lock(m_transitionLock, std::defer_lock);
+    if (!LockForHandoff(lock)) {
+        return false;
+    }
+    {
+        std::lock_guard<std::mutex> workerLock(m_workerLock);
+        m_worker.swap(standby);
+        m_worker->SetCancelEvent(nullptr);
+    }
+    m_handedOff = true;
+    m_timers.Stop();
+    OnHandoffComplete();
+    AdoptWorker();
+    return true;
+}
+
+bool ServiceBase::RelayHandoff(std::unique_ptr<HandoffChannel>& standby) {
+    HandoffChannel::MessageType reply;
+    std::string payload;
+    {
+        // Forwarded controls wait meanwhile, as they would while the
+        // instance serving handles one.
+        std::lock_guard<std::mutex> workerLock(m_workerLock);
+        HandoffChannel& worker = *m_worker;
+
+        worker.SetCancelEvent(m_handoffCancel);
+        const bool answered =
+            worker.SendValue(HandoffChannel::MessageHandoff, standby->GetPeerPid(),
+                kHandoffTimeout) &&
+            worker.Receive(reply, payload, kHandoffTimeout);
+        worker.SetCancelEvent(nullptr);
+        if (!answered) {
+            // A late answer would be taken for the reply to the next
+            // request. The instance serving stops once the pipe closes.
+            worker.Close();
+            return false;
+        }
+        if (reply != HandoffChannel::MessageState) {
+            return false;
+        }
+
+        if (!standby->Send(HandoffChannel::MessageState, payload, kHandoffTimeout) ||
+            !standby->Receive(reply, payload, kHandoffTimeout) ||
+            reply != HandoffChannel::MessageAck) {
+            worker.Send(HandoffChannel::MessageFailed, std::string(), kHandoffTimeout);
+            return false;
+        }
+
+        // Forward to the standby from now on, the previous instance exits.
+        m_worker.swap(standby);
+        m_worker->SetCancelEvent(nullptr);
+        standby->Send(HandoffChannel::MessageAck, std::string(), kHandoffTimeout);
+        standby->Close();
+    }
+
+    std::unique_lock<std::mutex> lock(m_transitionLock, std::defer_lock);
+    if (LockForHandoff(lock)) {
+        AdoptWorker();
+    }
+    return true;
+}
+
+void ServiceBase::AdoptWorker() {
+    if (m_workerProcess) {
+        ::CloseHandle(m_workerProcess);
+    }
+    // HandoffLoop() reports the service as stopped once it exits.
+    m_workerProcess = ::OpenProcess(SYNCHRONIZE | PROCESS_QUERY_LIMITED_INFORMATION,
+        FALSE, m_worker->GetPeerPid());
+    if (!m_workerProcess) {
+        std::cout << "Can't watch serving instance: " << ::GetLastError() << "\n";
+    }
+
+    // The new instance starts out running.
+    if (GetState() == SERVICE_PAUSED) {
+        ForwardControl(SERVICE_CONTROL_PAUSE);
+    }
+}
+
+void ServiceBase::ReleaseWorker() {
+    {
+        std::lock_guard<std::mutex> workerLock(m_workerLock);
+        m_worker.reset();
+    }
+    if (m_workerProcess) {
+        ::CloseHandle(m_workerProcess);
+        m_workerProcess = nullptr;
+    }
+    m_handedOff = false;
+}
+
+void ServiceBase::WorkerExited() {
+    DWORD exitCode = 0;
+    ::GetExitCodeProcess(m_workerProcess, &exitCode);
+
+    std::unique_lock<std::mutex> lock(m_transitionLock, std::defer_lock);
+    if (!LockForHandoff(lock)) {
+        return;
+    }
+
+    // Closed when it stopped answering, see ForwardControl().
+    bool answering = false;
+    {
+        std::lock_guard<std::mutex> workerLock(m_workerLock);
+        answering = m_worker->IsOpen();
+    }
+    std::cout << "Serving instance exited with " << exitCode << "\n";
+    ReleaseWorker();
+
+    // A stop with an error lets the failure actions of the service apply.
+    if (answering && exitCode == 0) {
+        SetStatus(SERVICE_STOP_PENDING);
+        SetStatus(SERVICE_STOPPED);
+    }
+    else {
+        SetStatus(SERVICE_STOPPED, ERROR_PROCESS_ABORTED);
+    }
+    m_recorder.Close();
+}
+
+void ServiceBase::ForwardControl(DWORD ctrlCode) {
+    std::lock_guard<std::mutex> workerLock(m_workerLock);
+    HandoffChannel::MessageType reply;
+    std::string ignored;
+    if (m_worker->SendValue(HandoffChannel::MessageControl, ctrlCode, kHandoffTimeout) &&
+        m_worker->Receive(reply, ignored, kHandoffTimeout) &&
+        reply == HandoffChannel::MessageAck) {
+        return;
+    }
+
+    // A late ack would be taken for the reply to the next request. The
+    // instance serving stops once the pipe closes.
+    std::cout << "Serving instance didn't handle control " << ctrlCode << "\n";
+    m_worker->Close();
+}
+
+void ServiceBase::RequestOverloadCheck(DWORD delayMs) {
+    // Runs on the timer wheel, so Stop() waits for it to finish.
+    if (!m_overloadCheckPending.exchange(true) &&
+        m_timers.Schedule(delayMs, [this] { ApplyOverloadState(); }) ==
+        TimerWheel::kInvalidTimer) {
+        m_overloadCheckPending = false;
+    }
+}
+
+void ServiceBase::ApplyOverloadState() {
+    // May end the overload, the check runs below anyway.
+    m_limiter.Refresh();
+    m_overloadCheckPending = false;
+
+    std::unique_lock<std::mutex> lock(m_transitionLock, std::try_to_lock);
+    if (!lock.owns_lock()) {
+        const DWORD state = GetState();
+        if (state != SERVICE_STOP_PENDING && state != SERVICE_STOPPED) {
+            RequestOverloadCheck(50);
+        }
+        return;
+    }
+
+    const bool overloaded = m_limiter.IsOverloaded();
+    const DWORD state = GetState();
+    if (overloaded && state == SERVICE_RUNNING) {
+        SetStatus(SERVICE_PAUSE_PENDING);
+        m_overloadPaused = true;
+        OnOverload(true);
+        SetStatus(SERVICE_PAUSED);
+    }
+    else if (!overloaded && m_overloadPaused && state == SERVICE_PAUSED) {
+        SetStatus(SERVICE_CONTINUE_PENDING);
+        m_overloadPaused = false;
+        OnOverload(false);
+        SetStatus(SERVICE_RUNNING);
+
+        // Time spent paused doesn't count as idle.
+        if (m_idleTimeout && !m_handedOff) {
+            NotifyActivity();
+            ArmIdleTimer(m_idleTimeout);
+        }
+    }
+
+    // Requests may have stopped completing, keep refreshing the latency.
+    if (m_overloadPaused) {
+        RequestOverloadCheck(kOverloadRecheckMs);
+    }
+}
+
+void ServiceBase::ArmIdleTimer(DWORD delayMs) {
+    // CheckIdle() may re-arm without m_transitionLock, so keep a single timer.
+    std::lock_guard<std::mutex> lock(m_idleLock);
+    m_timers.Cancel(m_idleTimer);
+    m_idleTimer = m_timers.Schedule(delayMs, [this] { CheckIdle(); });
+}
+
+void ServiceBase::CheckIdle() {
+    // The instance serving stops by itself.
+    if (m_handedOff) {
+        return;
+    }
+
+    // Stop() waits for running timer callbacks, so never block on it here.
+    std::unique_lock<std::mutex> lock(m_transitionLock, std::try_to_lock);
+    const DWORD state = GetState();
+    if (state == SERVICE_STOPPED || state == SERVICE_STOP_PENDING) {
+        return;
+    }
+    if (!lock.owns_lock()) {
+        ArmIdleTimer(kIdleRetryMs);
+        return;
+    }
+    if (state != SERVICE_RUNNING) {
+        // Idle time counts again once the service runs.
+        ArmIdleTimer(m_idleTimeout);
+        return;
+    }
+
+    if (m_activeCount > 0) {
+        ArmIdleTimer(m_idleTimeout);
+        return;
+    }
+
+    const ULONGLONG idle = ::GetTickCount64() - m_lastActivity;
+    if (idle < m_idleTimeout) {
+        ArmIdleTimer(static_cast<DWORD>(m_idleTimeout - idle));
+        return;
+    }
+
+    // Triggers start the service again on the next request.
+    StopLocked();
+}
@@ -0,0 +1,58 @@
+#include "Bench.h"
+#include "ControlTrace.h"
+
+#include <algorithm>
+#include <cstdio>
+
+double NowUs() {
+    static LARGE_INTEGER frequency = [] {
+        LARGE_INTEGER value;
+        ::QueryPerformanceFrequency(&value);
+        return value;
+    }();
+
+    LARGE_INTEGER counter;
+    ::QueryPerformanceCounter(&counter);
+    return counter.QuadPart * 1000000.0 / frequency.QuadPart;
+}
+
+const char* StateName(DWORD state) {
+    switch (state) {
+    case SERVICE_STOPPED: return "STOPPED";
+    case SERVICE_START_PENDING: return "START_PENDING";
+    case SERVICE_STOP_PENDING: return "STOP_PENDING";
+    case SERVICE_RUNNING: return "RUNNING";
+    case SERVICE_CONTINUE_PENDING: return "CONTINUE_PENDING";
+    case SERVICE_PAUSE_PENDING: return "PAUSE_PENDING";
+    case SERVICE_PAUSED: return "PAUSED";
+    default: return "UNKNOWN";
+    }
+}
+
+const char* ControlName(DWORD ctrlCode) {
+    switch (ctrlCode) {
+    case ControlRecorder::kStartCode: return "START";
+    case SERVICE_CONTROL_STOP: return "STOP";
+    case SERVICE_CONTROL_PAUSE: return "PAUSE";
+    case SERVICE_CONTROL_CONTINUE: return "CONTINUE";
+    case SERVICE_CONTROL_SHUTDOWN: return "SHUTDOWN";
+    case SERVICE_CONTROL_SESSIONCHANGE: return "SESSIONCHANGE";
+    case 0: return "(none)";
+    default: return "OTHER";
+    }
+}
+
+void PrintLatencies(const char* label, std::vector<double>& samplesUs) {
+    if (samplesUs.empty()) {
+        printf("%-44s n=0\n", label);
+        return;
+    }
+
+    std::sort(samplesUs.begin(), samplesUs.end());
+    auto percentile = [&samplesUs](double p) {
+        return samplesUs[static_cast<size_t>(p * (samplesUs.size() - 1))];
+    };
+    printf("%-44s n=%-8zu p50=%10.1fus p99=%10.1fus p999=%10.1fus max=%10.1fus\n",
+        label, samplesUs.size(), percentile(0.5), percentile(0.99),
+        percentile(0.999), samplesUs.back());
+}
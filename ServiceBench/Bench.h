@@ -0,0 +1,25 @@
+#ifndef SERVICE_BENCH_H_
+#define SERVICE_BENCH_H_
+
+#include <windows.h>
+#include <vector>
+
+// Microseconds since an arbitrary point in time.
+double NowUs();
+
+// Names of SERVICE_* states and controls, for reports.
+const char* StateName(DWORD state);
+const char* ControlName(DWORD ctrlCode);
+
+// Prints the count, p50, p99, p999 and max of |samplesUs|, which it sorts.
+void PrintLatencies(const char* label, std::vector<double>& samplesUs);
+
+// Benchmarks, each returns the exit code of the process.
+int RunTimerWheelBench(int argc, wchar_t* argv[]);
+int RunColdStartBench(int argc, wchar_t* argv[]);
+int RunReplayBench(int argc, wchar_t* argv[]);
+int RunStormBench(int argc, wchar_t* argv[]);
+int RunHandoffBench(int argc, wchar_t* argv[]);
+int RunOverloadBench(int argc, wchar_t* argv[]);
+
+#endif // SERVICE_BENCH_H_
@@ -0,0 +1,227 @@
+#include "Bench.h"
+#include "Service_Base.h"
+#include "ServiceDriver.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cwchar>
+#include <string>
+#include <thread>
+
+// Measures how long the first request to a demand-started service takes,
+// from the activation to the response. The benchmark acts as the activator
+// the SCM is for a service with a named pipe trigger: it starts the service
+// process, and the client polls for the pipe like a client would during the
+// trigger start. The service idle-stops between iterations.
+
+namespace {
+    const DWORD kIdleTimeoutMs = 500;
+    const DWORD kActivationTimeoutMs = 10000;
+    const int kWarmRequests = 10;
+
+    class ColdStartService : public ServiceBase {
+    public:
+        explicit ColdStartService(const std::wstring& pipeName)
+            : ServiceBase(L"ServiceBenchColdStart",
+                L"ServiceBench cold start",
+                SERVICE_DEMAND_START),
+            m_pipeName(pipeName),
+            m_quit(::CreateEventW(nullptr, TRUE, FALSE, nullptr)) {
+            SetIdleTimeout(kIdleTimeoutMs);
+        }
+
+        ~ColdStartService() {
+            ::CloseHandle(m_quit);
+        }
+
+    protected:
+        void OnStart(DWORD /*argc*/, wchar_t* /*argv*/[]) override {
+            ::ResetEvent(m_quit);
+            m_server = std::thread(&ColdStartService::Serve, this);
+        }
+
+        void OnStop() override {
+            // Ends the wait for a client wherever the server thread is.
+            ::SetEvent(m_quit);
+            if (m_server.joinable()) {
+                m_server.join();
+            }
+        }
+
+    private:
+        // Waits for |io| to complete, giving up once m_quit is set.
+        bool Complete(HANDLE pipe, OVERLAPPED& io, BOOL started, DWORD& transferred) {
+            if (!started && ::GetLastError() != ERROR_IO_PENDING) {
+                return false;
+            }
+            HANDLE events[] = { io.hEvent, m_quit };
+            if (::WaitForMultipleObjects(2, events, FALSE, INFINITE) != WAIT_OBJECT_0) {
+                ::CancelIoEx(pipe, &io);
+                ::GetOverlappedResult(pipe, &io, &transferred, TRUE);
+                return false;
+            }
+            return ::GetOverlappedResult(pipe, &io, &transferred, FALSE) == TRUE;
+        }
+
+        // Echoes one byte per connection.
+        void Serve() {
+            OVERLAPPED io = {};
+            io.hEvent = ::CreateEventW(nullptr, TRUE, FALSE, nullptr);
+
+            while (::WaitForSingleObject(m_quit, 0) != WAIT_OBJECT_0) {
+                HANDLE pipe = ::CreateNamedPipeW(m_pipeName.c_str(),
+                    PIPE_ACCESS_DUPLEX | FILE_FLAG_OVERLAPPED,
+                    PIPE_TYPE_BYTE | PIPE_WAIT | PIPE_REJECT_REMOTE_CLIENTS,
+                    PIPE_UNLIMITED_INSTANCES, 64, 64, 0, nullptr);
+                if (pipe == INVALID_HANDLE_VALUE) {
+                    printf("Couldn't create pipe: %lu\n", ::GetLastError());
+                    break;
+                }
+
+                DWORD transferred = 0;
+                ::ResetEvent(io.hEvent);
+                bool connected = ::ConnectNamedPipe(pipe, &io) ||
+                    ::GetLastError() == ERROR_PIPE_CONNECTED;
+                if (!connected) {
+                    connected = Complete(pipe, io, FALSE, transferred);
+                }
+
+                if (connected) {
+                    BeginActivity();
+                    char request = 0;
+                    ::ResetEvent(io.hEvent);
+                    if (Complete(pipe, io, ::ReadFile(pipe, &request, 1, nullptr, &io),
+                        transferred) && transferred == 1) {
+                        ::ResetEvent(io.hEvent);
+                        Complete(pipe, io, ::WriteFile(pipe, &request, 1, nullptr, &io),
+                            transferred);
+                        ::FlushFileBuffers(pipe);
+                    }
+                    EndActivity();
+                }
+                ::CloseHandle(pipe);
+            }
+            ::CloseHandle(io.hEvent);
+        }
+
+        const std::wstring m_pipeName;
+        // Set to stop serving, manual reset.
+        HANDLE m_quit;
+        std::thread m_server;
+    };
+
+    // Runs in the service process, started by the activator below.
+    int Serve(const std::wstring& pipeName) {
+        ColdStartService service(pipeName);
+        ServiceDriver driver(service);
+        driver.Start(0, nullptr);
+
+        while (driver.GetState() != SERVICE_STOPPED) {
+            ::Sleep(10);
+        }
+        return 0;
+    }
+
+    // Sends one request, waiting up to |timeoutMs| for the pipe to appear.
+    bool Request(const std::wstring& pipeName, DWORD timeoutMs) {
+        const ULONGLONG deadline = ::GetTickCount64() + timeoutMs;
+
+        HANDLE pipe = INVALID_HANDLE_VALUE;
+        while (pipe == INVALID_HANDLE_VALUE) {
+            pipe = ::CreateFileW(pipeName.c_str(), GENERIC_READ | GENERIC_WRITE,
+                0, nullptr, OPEN_EXISTING, 0, nullptr);
+            if (pipe != INVALID_HANDLE_VALUE) {
+                break;
+            }
+            if (::GetTickCount64() > deadline) {
+                return false;
+            }
+            if (::GetLastError() == ERROR_PIPE_BUSY) {
+                ::WaitNamedPipeW(pipeName.c_str(), timeoutMs);
+            }
+            else {
+                // Sleep(1) would round every attempt up to the timer
+                // resolution, which is larger than what is measured.
+                ::Sleep(0);
+            }
+        }
+
+        char data = 'x';
+        DWORD transferred = 0;
+        const bool ok = ::WriteFile(pipe, &data, 1, &transferred, nullptr) &&
+            ::ReadFile(pipe, &data, 1, &transferred, nullptr) && transferred == 1;
+        ::CloseHandle(pipe);
+        return ok;
+    }
+}
+
+int RunColdStartBench(int argc, wchar_t* argv[]) {
+    if (argc >= 2 && wcscmp(argv[0], L"--serve") == 0) {
+        return Serve(argv[1]);
+    }
+
+    const int iterations = argc > 0 ? _wtoi(argv[0]) : 20;
+    if (iterations <= 0) {
+        printf("Usage: ServiceBench coldstart [iterations]\n");
+        return 2;
+    }
+
+    wchar_t modulePath[MAX_PATH];
+    if (::GetModuleFileNameW(nullptr, modulePath, MAX_PATH) == 0) {
+        printf("Couldn't get module file name: %lu\n", ::GetLastError());
+        return 1;
+    }
+    const std::wstring pipeName = L"\\\\.\\pipe\\ServiceBenchColdStart-" +
+        std::to_wstring(::GetCurrentProcessId());
+
+    std::vector<double> coldUs;
+    std::vector<double> warmUs;
+    std::vector<double> idleStopUs;
+
+    for (int i = 0; i < iterations; ++i) {
+        std::wstring commandLine = L"\"" + std::wstring(modulePath) +
+            L"\" coldstart --serve " + pipeName;
+
+        STARTUPINFOW startupInfo = { sizeof(startupInfo) };
+        PROCESS_INFORMATION process = {};
+
+        const double activated = NowUs();
+        if (!::CreateProcessW(modulePath, &commandLine[0], nullptr, nullptr, FALSE,
+            0, nullptr, nullptr, &startupInfo, &process)) {
+            printf("Couldn't start service process: %lu\n", ::GetLastError());
+            return 1;
+        }
+        ::CloseHandle(process.hThread);
+
+        const bool served = Request(pipeName, kActivationTimeoutMs);
+        coldUs.push_back(NowUs() - activated);
+
+        for (int j = 0; served && j < kWarmRequests; ++j) {
+            const double started = NowUs();
+            Request(pipeName, kActivationTimeoutMs);
+            warmUs.push_back(NowUs() - started);
+        }
+
+        const double lastRequest = NowUs();
+        if (::WaitForSingleObject(process.hProcess, kIdleTimeoutMs * 10) != WAIT_OBJECT_0) {
+            printf("Service didn't stop when idle\n");
+            ::TerminateProcess(process.hProcess, 1);
+        }
+        else {
+            idleStopUs.push_back(NowUs() - lastRequest);
+        }
+        ::CloseHandle(process.hProcess);
+
+        if (!served) {
+            printf("Service didn't answer after activation\n");
+            return 1;
+        }
+    }
+
+    PrintLatencies("first request after start", coldUs);
+    PrintLatencies("warm request", warmUs);
+    char label[64];
+    sprintf_s(label, "exit after %lums idle", kIdleTimeoutMs);
+    PrintLatencies(label, idleStopUs);
+    return 0;
+}
@@ -0,0 +1,319 @@
+#include "Handoff.h"
+#include "Bench.h"
+#include "Service_Base.h"
+#include "ServiceDriver.h"
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cwchar>
+#include <string>
+#include <thread>
+
+// Measures the gap in serving requests while standby instances take over a
+// listening socket. The benchmark process is the host, driven by a
+// ServiceDriver, and each rollout starts a standby process. From the second
+// rollout on the host relays the handoff from the instance serving, which
+// exits afterwards. A client keeps sending requests over loopback the whole
+// time; every response carries the process id of the instance serving it.
+
+namespace {
+    const DWORD kTakeoverTimeoutMs = 30000;
+    const DWORD kExitTimeoutMs = 10000;
+    // Lets requests reach the new instance before the next rollout.
+    const DWORD kSettleMs = 200;
+
+    class HandoffService : public ServiceBase {
+    public:
+        HandoffService(const std::wstring& name, SOCKET listener)
+            : ServiceBase(name,
+                L"ServiceBench handoff",
+                SERVICE_DEMAND_START),
+            m_listener(listener) {
+            EnableHandoff();
+        }
+
+    protected:
+        void OnStart(DWORD /*argc*/, wchar_t* /*argv*/[]) override {
+            StartServing();
+        }
+
+        void OnStop() override {
+            StopServing();
+        }
+
+        bool OnHandoff(HandoffState& state) override {
+            state.sockets.push_back(m_listener);
+            return true;
+        }
+
+        void OnHandoffComplete() override {
+            StopServing();
+        }
+
+        bool OnTakeover(const HandoffState& state) override {
+            if (state.sockets.size() != 1) {
+                return false;
+            }
+            m_listener = state.sockets[0];
+            StartServing();
+            return true;
+        }
+
+    private:
+        void StartServing() {
+            m_quit = false;
+            m_server = std::thread(&HandoffService::Serve, this);
+        }
+
+        void StopServing() {
+            m_quit = true;
+            m_server.join();
+            // The next instance keeps its own copy of the socket open.
+            ::closesocket(m_listener);
+            m_listener = INVALID_SOCKET;
+        }
+
+        // Answers each connection with the id of this process. The listening
+        // socket is non-blocking, as the other instance may accept a
+        // connection first while both serve.
+        void Serve() {
+            const DWORD pid = ::GetCurrentProcessId();
+            while (!m_quit) {
+                fd_set readable;
+                FD_ZERO(&readable);
+                FD_SET(m_listener, &readable);
+                timeval timeout = { 0, 10000 };
+                if (::select(0, &readable, nullptr, nullptr, &timeout) <= 0) {
+                    continue;
+                }
+
+                SOCKET client = ::accept(m_listener, nullptr, nullptr);
+                if (client == INVALID_SOCKET) {
+                    continue;
+                }
+                u_long blocking = 0;
+                ::ioctlsocket(client, FIONBIO, &blocking);
+
+                BeginActivity();
+                char request = 0;
+                if (::recv(client, &request, 1, 0) == 1) {
+                    ::send(client, reinterpret_cast<const char*>(&pid), sizeof(pid), 0);
+                }
+                EndActivity();
+                ::closesocket(client);
+            }
+        }
+
+        SOCKET m_listener;
+        std::atomic<bool> m_quit{ false };
+        std::thread m_server;
+    };
+
+    // Runs in a standby process started by the rollouts below.
+    int Standby(const std::wstring& name) {
+        HandoffService service(name, INVALID_SOCKET);
+        return service.RunStandby(0, nullptr) ? 0 : 1;
+    }
+
+    // Sends one request and returns the process id of the instance serving
+    // it, or zero.
+    DWORD Request(USHORT port) {
+        SOCKET socket = ::socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        if (socket == INVALID_SOCKET) {
+            return 0;
+        }
+
+        // A connection left in the backlog with nobody accepting fails.
+        const DWORD timeoutMs = 5000;
+        ::setsockopt(socket, SOL_SOCKET, SO_RCVTIMEO,
+            reinterpret_cast<const char*>(&timeoutMs), sizeof(timeoutMs));
+        // Reset on close, so many short connections don't use up the
+        // ephemeral ports in TIME_WAIT.
+        linger abortive = { 1, 0 };
+        ::setsockopt(socket, SOL_SOCKET, SO_LINGER,
+            reinterpret_cast<const char*>(&abortive), sizeof(abortive));
+
+        sockaddr_in address = {};
+        address.sin_family = AF_INET;
+        address.sin_port = htons(port);
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+        DWORD pid = 0;
+        char request = 'x';
+        if (::connect(socket, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 ||
+            ::send(socket, &request, 1, 0) != 1 ||
+            ::recv(socket, reinterpret_cast<char*>(&pid), sizeof(pid), MSG_WAITALL) !=
+            sizeof(pid)) {
+            pid = 0;
+        }
+        ::closesocket(socket);
+        return pid;
+    }
+
+    class Client {
+    public:
+        explicit Client(USHORT port)
+            : m_port(port),
+            m_thread(&Client::Run, this) {}
+
+        void Stop() {
+            m_quit = true;
+            m_thread.join();
+        }
+
+        DWORD GetLastServer() const { return m_lastServer; }
+
+        void Report() {
+            printf("%llu requests, %llu failed, served by %llu instances\n",
+                static_cast<unsigned long long>(m_latencies.size()),
+                m_failed, m_servers);
+            PrintLatencies("request", m_latencies);
+            PrintLatencies("gap between responses", m_gaps);
+        }
+
+    private:
+        void Run() {
+            double lastResponse = NowUs();
+            while (!m_quit) {
+                const double started = NowUs();
+                const DWORD server = Request(m_port);
+                const double now = NowUs();
+                if (!server) {
+                    ++m_failed;
+                    continue;
+                }
+
+                m_latencies.push_back(now - started);
+                m_gaps.push_back(now - lastResponse);
+                lastResponse = now;
+                if (server != m_lastServer) {
+                    ++m_servers;
+                    m_lastServer = server;
+                }
+            }
+        }
+
+        const USHORT m_port;
+        std::atomic<bool> m_quit{ false };
+        std::atomic<DWORD> m_lastServer{ 0 };
+        unsigned long long m_failed = 0;
+        unsigned long long m_servers = 0;
+        std::vector<double> m_latencies;
+        std::vector<double> m_gaps;
+        std::thread m_thread;
+    };
+
+    SOCKET Listen(USHORT& port) {
+        SOCKET listener = ::socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        if (listener == INVALID_SOCKET) {
+            return INVALID_SOCKET;
+        }
+
+        sockaddr_in address = {};
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        int size = sizeof(address);
+        u_long nonBlocking = 1;
+        if (::bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 ||
+            ::listen(listener, SOMAXCONN) != 0 ||
+            ::getsockname(listener, reinterpret_cast<sockaddr*>(&address), &size) != 0 ||
+            ::ioctlsocket(listener, FIONBIO, &nonBlocking) != 0) {
+            ::closesocket(listener);
+            return INVALID_SOCKET;
+        }
+        port = ntohs(address.sin_port);
+        return listener;
+    }
+
+    // Starts a standby and waits until it serves the client.
+    bool Rollout(const std::wstring& name, Client& client, HANDLE& standby) {
+        wchar_t modulePath[MAX_PATH];
+        if (::GetModuleFileNameW(nullptr, modulePath, MAX_PATH) == 0) {
+            printf("Couldn't get module file name: %lu\n", ::GetLastError());
+            return false;
+        }
+        std::wstring commandLine = L"\"" + std::wstring(modulePath) +
+            L"\" handoff --standby " + name;
+
+        STARTUPINFOW startupInfo = { sizeof(startupInfo) };
+        PROCESS_INFORMATION process = {};
+        if (!::CreateProcessW(modulePath, &commandLine[0], nullptr, nullptr, FALSE,
+            0, nullptr, nullptr, &startupInfo, &process)) {
+            printf("Couldn't start standby process: %lu\n", ::GetLastError());
+            return false;
+        }
+        ::CloseHandle(process.hThread);
+        standby = process.hProcess;
+
+        const ULONGLONG deadline = ::GetTickCount64() + kTakeoverTimeoutMs;
+        while (client.GetLastServer() != process.dwProcessId) {
+            if (::WaitForSingleObject(process.hProcess, 10) == WAIT_OBJECT_0 ||
+                ::GetTickCount64() > deadline) {
+                printf("Standby %lu didn't take over\n", process.dwProcessId);
+                return false;
+            }
+        }
+        ::Sleep(kSettleMs);
+        return true;
+    }
+}
+
+int RunHandoffBench(int argc, wchar_t* argv[]) {
+    if (argc >= 2 && wcscmp(argv[0], L"--standby") == 0) {
+        return Standby(argv[1]);
+    }
+
+    const int rollouts = argc > 0 ? _wtoi(argv[0]) : 3;
+    if (rollouts <= 0) {
+        printf("Usage: ServiceBench handoff [rollouts]\n");
+        return 2;
+    }
+
+    WSADATA wsaData;
+    if (::WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) {
+        printf("Couldn't initialize Winsock\n");
+        return 1;
+    }
+    USHORT port = 0;
+    SOCKET listener = Listen(port);
+    if (listener == INVALID_SOCKET) {
+        printf("Couldn't listen: %d\n", ::WSAGetLastError());
+        return 1;
+    }
+
+    const std::wstring name = L"ServiceBenchHandoff-" +
+        std::to_wstring(::GetCurrentProcessId());
+    HandoffService host(name, listener);
+    ServiceDriver driver(host);
+    driver.Start(0, nullptr);
+
+    Client client(port);
+    ::Sleep(kSettleMs);
+
+    std::vector<HANDLE> standbys;
+    bool ok = true;
+    for (int i = 0; ok && i < rollouts; ++i) {
+        HANDLE standby = nullptr;
+        ok = Rollout(name, client, standby);
+        if (standby) {
+            standbys.push_back(standby);
+        }
+    }
+
+    client.Stop();
+    // Forwarded to the instance serving, the previous ones exited already.
+    driver.Control(SERVICE_CONTROL_STOP);
+    for (HANDLE standby : standbys) {
+        if (::WaitForSingleObject(standby, kExitTimeoutMs) != WAIT_OBJECT_0) {
+            printf("Standby didn't exit\n");
+            ::TerminateProcess(standby, 1);
+            ok = false;
+        }
+        ::CloseHandle(standby);
+    }
+
+    client.Report();
+    ::WSACleanup();
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,208 @@
+#include "Bench.h"
+#include "Service_Base.h"
+#include "ServiceDriver.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+// Offers a service twice the load it can handle, with and without the
+// concurrency limiter in front of its request queue, and reports goodput
+// (requests answered within the deadline per second) and the latency of
+// the requests served. With the limiter the service also pauses because of
+// overload, and the time it takes to report SERVICE_RUNNING again once the
+// load stops is measured.
+
+namespace {
+    const DWORD kWorkers = 4;
+    const double kServiceUs = 1000;
+    const DWORD kTargetLatencyMs = 10;
+    // Answers later than this are useless to the client.
+    const DWORD kDeadlineMs = 50;
+    const DWORD kRecoveryTimeoutMs = 10000;
+
+    class OverloadService : public ServiceBase {
+    public:
+        explicit OverloadService(bool limited)
+            : ServiceBase(L"ServiceBenchOverload",
+                L"ServiceBench overload",
+                SERVICE_DEMAND_START,
+                SERVICE_ERROR_NORMAL,
+                SERVICE_ACCEPT_STOP | SERVICE_ACCEPT_PAUSE_CONTINUE),
+            m_limited(limited) {
+            LimiterOptions options;
+            options.targetLatencyMs = kTargetLatencyMs;
+            options.initialLimit = kWorkers;
+            // Pause as soon as the target is missed, so the pause and the
+            // recovery happen during a short run.
+            options.overloadFactor = 1.0;
+            GetLimiter().SetOptions(options);
+            if (m_limited) {
+                EnableOverloadPause();
+            }
+        }
+
+        // Returns false if the request was shed.
+        bool Submit() {
+            if (m_limited && !GetLimiter().Acquire()) {
+                return false;
+            }
+            {
+                std::lock_guard<std::mutex> lock(m_lock);
+                m_queue.push_back(NowUs());
+            }
+            m_queued.notify_one();
+            return true;
+        }
+
+        // Waits until every submitted request is answered.
+        void Drain() {
+            std::unique_lock<std::mutex> lock(m_lock);
+            m_drained.wait(lock, [this] { return m_queue.empty() && m_busy == 0; });
+        }
+
+        // Latencies of the answered requests, valid once stopped.
+        std::vector<double>& GetLatencies() { return m_latencies; }
+
+    protected:
+        void OnStart(DWORD /*argc*/, wchar_t* /*argv*/[]) override {
+            m_quit = false;
+            for (DWORD i = 0; i < kWorkers; ++i) {
+                m_workers.emplace_back(&OverloadService::Work, this);
+            }
+        }
+
+        void OnStop() override {
+            {
+                std::lock_guard<std::mutex> lock(m_lock);
+                m_quit = true;
+            }
+            m_queued.notify_all();
+            for (std::thread& worker : m_workers) {
+                worker.join();
+            }
+            m_workers.clear();
+        }
+
+    private:
+        void Work() {
+            std::unique_lock<std::mutex> lock(m_lock);
+            for (;;) {
+                m_queued.wait(lock, [this] { return m_quit || !m_queue.empty(); });
+                if (m_quit) {
+                    return;
+                }
+                const double arrived = m_queue.front();
+                m_queue.pop_front();
+                ++m_busy;
+                lock.unlock();
+
+                const double until = NowUs() + kServiceUs;
+                while (NowUs() < until) {
+                }
+                const double latencyUs = NowUs() - arrived;
+                if (m_limited) {
+                    GetLimiter().Release(static_cast<ULONGLONG>(latencyUs));
+                }
+
+                lock.lock();
+                --m_busy;
+                m_latencies.push_back(latencyUs);
+                if (m_queue.empty() && m_busy == 0) {
+                    m_drained.notify_all();
+                }
+            }
+        }
+
+        const bool m_limited;
+        std::mutex m_lock;
+        std::condition_variable m_queued;
+        std::condition_variable m_drained;
+        std::deque<double> m_queue;
+        DWORD m_busy = 0;
+        bool m_quit = false;
+        std::vector<double> m_latencies;
+        std::vector<std::thread> m_workers;
+    };
+
+    bool Run(bool limited, DWORD seconds) {
+        std::atomic<unsigned long long> pauses{ 0 };
+        OverloadService service(limited);
+        ServiceDriver driver(service);
+
+        driver.SetStatusObserver([&pauses](DWORD from, DWORD to, DWORD /*errCode*/) {
+            if (from != to && to == SERVICE_PAUSED) {
+                ++pauses;
+            }
+        });
+        driver.Start(0, nullptr);
+
+        // Open loop: requests keep arriving at the offered rate however
+        // slowly they are answered, like independent clients.
+        const double intervalUs = kServiceUs / kWorkers / 2;
+        const double started = NowUs();
+        const double end = started + seconds * 1000000.0;
+        unsigned long long offered = 0;
+        unsigned long long shed = 0;
+        for (double next = started; next < end; next += intervalUs) {
+            while (NowUs() < next) {
+                std::this_thread::yield();
+            }
+            ++offered;
+            if (!service.Submit()) {
+                ++shed;
+            }
+        }
+        service.Drain();
+
+        // Nothing completes anymore, the overload has to end by itself.
+        double recoveryUs = -1;
+        const double idleSince = NowUs();
+        while (NowUs() - idleSince < kRecoveryTimeoutMs * 1000.0) {
+            if (driver.GetState() == SERVICE_RUNNING) {
+                recoveryUs = NowUs() - idleSince;
+                break;
+            }
+            ::Sleep(1);
+        }
+        driver.Control(SERVICE_CONTROL_STOP);
+
+        std::vector<double>& latencies = service.GetLatencies();
+        unsigned long long good = 0;
+        for (double latencyUs : latencies) {
+            if (latencyUs <= kDeadlineMs * 1000.0) {
+                ++good;
+            }
+        }
+
+        printf("%s: offered %llu, shed %llu, answered %zu, goodput %.0f/s, %llu overload pauses\n",
+            limited ? "limiter" : "no limiter", offered, shed, latencies.size(),
+            good / static_cast<double>(seconds), pauses.load());
+        PrintLatencies(limited ? "latency with limiter" : "latency without limiter",
+            latencies);
+        if (recoveryUs < 0) {
+            printf("Still paused %lums after the load stopped\n", kRecoveryTimeoutMs);
+            return false;
+        }
+        printf("running again %.1fms after the load stopped\n", recoveryUs / 1000.0);
+        return true;
+    }
+}
+
+int RunOverloadBench(int argc, wchar_t* argv[]) {
+    const DWORD seconds = argc > 0 ? wcstoul(argv[0], nullptr, 10) : 3;
+    if (seconds == 0) {
+        printf("Usage: ServiceBench overload [seconds]\n");
+        return 2;
+    }
+
+    printf("%lu workers, %.0fus per request, offered %.0f/s, deadline %lums\n",
+        kWorkers, kServiceUs, 2 * kWorkers * 1000000.0 / kServiceUs, kDeadlineMs);
+    const bool unlimited = Run(false, seconds);
+    const bool limited = Run(true, seconds);
+    return unlimited && limited ? 0 : 1;
+}
@@ -0,0 +1,76 @@
+#include "Bench.h"
+#include "ControlTrace.h"
+#include "Service_Base.h"
+
+#include <cstdio>
+#include <cwchar>
+#include <map>
+#include <string>
+
+// Replays a recorded control trace against a service whose handlers do
+// nothing, so the report shows what ServiceBase itself costs per request
+// and per state transition. Meant for running incident traces in CI.
+
+namespace {
+    class ReplayService : public ServiceBase {
+    public:
+        ReplayService()
+            : ServiceBase(L"ServiceBenchReplay",
+                L"ServiceBench replay",
+                SERVICE_DEMAND_START,
+                SERVICE_ERROR_NORMAL,
+                SERVICE_ACCEPT_STOP | SERVICE_ACCEPT_PAUSE_CONTINUE |
+                SERVICE_ACCEPT_SHUTDOWN | SERVICE_ACCEPT_SESSIONCHANGE) {}
+
+    protected:
+        void OnStart(DWORD /*argc*/, wchar_t* /*argv*/[]) override {}
+    };
+}
+
+int RunReplayBench(int argc, wchar_t* argv[]) {
+    if (argc < 1) {
+        printf("Usage: ServiceBench replay <trace> [--realtime]\n");
+        return 2;
+    }
+    const bool realTime = argc > 1 && wcscmp(argv[1], L"--realtime") == 0;
+
+    ControlReplayer replayer;
+    if (!replayer.Load(argv[0])) {
+        return 1;
+    }
+
+    ReplayService service;
+    std::vector<ReplayResult> results;
+    std::vector<ReplayTransition> transitions;
+    if (!replayer.Replay(service, realTime, results, &transitions)) {
+        return 1;
+    }
+
+    std::map<std::string, std::vector<double>> byRequest;
+    for (const ReplayResult& result : results) {
+        byRequest[ControlName(result.ctrlCode)].push_back(
+            static_cast<double>(result.latencyUs));
+    }
+    std::map<std::string, std::vector<double>> byTransition;
+    size_t unsolicited = 0;
+    for (const ReplayTransition& transition : transitions) {
+        // Changes the service made by itself have no latency to report.
+        if (transition.ctrlCode == 0) {
+            ++unsolicited;
+            continue;
+        }
+        const std::string name = std::string(StateName(transition.from)) +
+            " -> " + StateName(transition.to);
+        byTransition[name].push_back(static_cast<double>(transition.latencyUs));
+    }
+
+    printf("%zu requests, %zu transitions, %zu of them unsolicited\n",
+        results.size(), transitions.size(), unsolicited);
+    for (auto& request : byRequest) {
+        PrintLatencies(request.first.c_str(), request.second);
+    }
+    for (auto& transition : byTransition) {
+        PrintLatencies(transition.first.c_str(), transition.second);
+    }
+    return 0;
+}
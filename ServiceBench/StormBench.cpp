@@ -0,0 +1,230 @@
+#include "Bench.h"
+#include "Service_Base.h"
+#include "ServiceDriver.h"
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+
+// Fires randomized control requests from several threads at once at a
+// service driven by a ServiceDriver, like an SCM racing operators, session
+// changes and the idle timeout of the service. Every reported state change
+// is checked against the transitions the SCM accepts, and the latency from
+// request to state change is reported per transition. Exits with an error
+// on an illegal transition or when the service stops making progress.
+
+namespace {
+    const DWORD kIdleTimeoutMs = 5;
+    // No request completing for this long is reported as a deadlock.
+    const DWORD kStallTimeoutMs = 10000;
+
+    // Busy work of a random length, so handlers overlap in many ways.
+    void Work(std::mt19937& random, DWORD maxUs) {
+        const double until = NowUs() + random() % (maxUs + 1);
+        while (NowUs() < until) {
+            std::this_thread::yield();
+        }
+    }
+
+    class StormService : public ServiceBase {
+    public:
+        StormService()
+            : ServiceBase(L"ServiceBenchStorm",
+                L"ServiceBench control storm",
+                SERVICE_DEMAND_START,
+                SERVICE_ERROR_NORMAL,
+                SERVICE_ACCEPT_STOP | SERVICE_ACCEPT_PAUSE_CONTINUE |
+                SERVICE_ACCEPT_SHUTDOWN | SERVICE_ACCEPT_SESSIONCHANGE) {
+            SetIdleTimeout(kIdleTimeoutMs);
+        }
+
+    protected:
+        void OnStart(DWORD /*argc*/, wchar_t* /*argv*/[]) override {
+            Handler();
+            GetTimers().Schedule(1, [this] { ++m_ticks; }, 1);
+        }
+        void OnStop() override { Handler(); }
+        void OnPause() override { Handler(); }
+        void OnContinue() override { Handler(); }
+        void OnShutdown() override { Handler(); }
+
+        void OnSessionChange(DWORD /*evtType*/,
+            WTSSESSION_NOTIFICATION* /*notification*/) override {
+            BeginActivity();
+            Handler();
+            EndActivity();
+        }
+
+    private:
+        void Handler() {
+            thread_local std::mt19937 random(std::random_device{}());
+            Work(random, 100);
+        }
+
+        std::atomic<unsigned long long> m_ticks{ 0 };
+    };
+
+    // Request a storm thread is delivering.
+    struct PendingRequest {
+        DWORD ctrlCode;
+        double startedUs;
+    };
+    thread_local const PendingRequest* t_request = nullptr;
+
+    class Storm {
+    public:
+        explicit Storm(ServiceDriver& driver)
+            : m_driver(driver) {
+            m_driver.SetStatusObserver([this](DWORD from, DWORD to, DWORD errCode) {
+                Observe(from, to, errCode);
+            });
+        }
+
+        ~Storm() {
+            m_driver.SetStatusObserver(nullptr);
+        }
+
+        void Run(DWORD seconds, DWORD threads) {
+            const double deadline = NowUs() + seconds * 1000000.0;
+            std::vector<std::thread> workers;
+            for (DWORD i = 0; i < threads; ++i) {
+                workers.emplace_back(&Storm::Worker, this, deadline, i);
+            }
+
+            // Watchdog: the transitions are serialized, so a lost wakeup or
+            // a lock order problem shows up as no request completing.
+            unsigned long long lastDone = 0;
+            double lastProgress = NowUs();
+            while (NowUs() < deadline && !m_stalled) {
+                ::Sleep(100);
+                const unsigned long long done = m_done;
+                if (done != lastDone) {
+                    lastDone = done;
+                    lastProgress = NowUs();
+                }
+                else if (NowUs() - lastProgress > kStallTimeoutMs * 1000.0) {
+                    m_stalled = true;
+                }
+            }
+            if (m_stalled) {
+                printf("No request completed for %lums, the service is stuck in %s\n",
+                    kStallTimeoutMs, StateName(m_driver.GetState()));
+                // The workers can't be joined, so leave without unwinding.
+                fflush(stdout);
+                ::ExitProcess(1);
+            }
+
+            for (std::thread& worker : workers) {
+                worker.join();
+            }
+            m_driver.Control(SERVICE_CONTROL_STOP);
+        }
+
+        bool Report() {
+            std::lock_guard<std::mutex> lock(m_lock);
+            printf("%llu requests, %llu transitions, %llu unsolicited, %llu illegal\n",
+                m_done.load(), m_transitions, m_unsolicited, m_illegal);
+            for (auto& transition : m_latencies) {
+                PrintLatencies(transition.first.c_str(), transition.second);
+            }
+            return m_illegal == 0;
+        }
+
+    private:
+        void Worker(double deadline, DWORD index) {
+            std::mt19937 random(index * 7919 + 1);
+            WTSSESSION_NOTIFICATION notification = { sizeof(notification), 1 };
+
+            while (NowUs() < deadline && !m_stalled) {
+                DWORD ctrlCode = 0;
+                switch (random() % 8) {
+                case 0:
+                case 1: ctrlCode = ControlRecorder::kStartCode; break;
+                case 2: ctrlCode = SERVICE_CONTROL_STOP; break;
+                case 3:
+                case 4: ctrlCode = SERVICE_CONTROL_PAUSE; break;
+                case 5: ctrlCode = SERVICE_CONTROL_CONTINUE; break;
+                case 6: ctrlCode = SERVICE_CONTROL_SHUTDOWN; break;
+                default: ctrlCode = SERVICE_CONTROL_SESSIONCHANGE; break;
+                }
+
+                const PendingRequest request = { ctrlCode, NowUs() };
+                t_request = &request;
+                if (ctrlCode == ControlRecorder::kStartCode) {
+                    // The SCM only starts a stopped service.
+                    if (m_driver.GetState() == SERVICE_STOPPED) {
+                        m_driver.Start(0, nullptr);
+                    }
+                }
+                else {
+                    m_driver.Control(ctrlCode, WTS_SESSION_LOCK, &notification);
+                }
+                t_request = nullptr;
+                ++m_done;
+
+                Work(random, 200);
+            }
+        }
+
+        // Runs under the status lock of the service, so calls are ordered.
+        void Observe(DWORD from, DWORD to, DWORD errCode) {
+            const PendingRequest* request = t_request;
+            const double now = NowUs();
+
+            std::lock_guard<std::mutex> lock(m_lock);
+            if (!ServiceDriver::IsLegalTransition(from, to, errCode)) {
+                ++m_illegal;
+                printf("Illegal transition %s -> %s (error %lu)\n",
+                    StateName(from), StateName(to), errCode);
+            }
+            if (from == to) {
+                return;
+            }
+            ++m_transitions;
+
+            if (!request) {
+                // Made by the service itself, e.g. an idle stop.
+                ++m_unsolicited;
+                return;
+            }
+            const std::string name = std::string(ControlName(request->ctrlCode)) +
+                ": " + StateName(from) + " -> " + StateName(to);
+            m_latencies[name].push_back(now - request->startedUs);
+        }
+
+        ServiceDriver& m_driver;
+
+        std::atomic<unsigned long long> m_done{ 0 };
+        std::atomic<bool> m_stalled{ false };
+
+        std::mutex m_lock;
+        unsigned long long m_transitions = 0;
+        unsigned long long m_unsolicited = 0;
+        unsigned long long m_illegal = 0;
+        std::map<std::string, std::vector<double>> m_latencies;
+    };
+}
+
+int RunStormBench(int argc, wchar_t* argv[]) {
+    const DWORD seconds = argc > 0 ? wcstoul(argv[0], nullptr, 10) : 5;
+    const DWORD threads = argc > 1 ? wcstoul(argv[1], nullptr, 10) : 8;
+    if (seconds == 0 || threads == 0) {
+        printf("Usage: ServiceBench storm [seconds] [threads]\n");
+        return 2;
+    }
+
+    StormService service;
+    ServiceDriver driver(service);
+    bool legal = false;
+    {
+        Storm storm(driver);
+        storm.Run(seconds, threads);
+        legal = storm.Report();
+    }
+    return legal ? 0 : 1;
+}
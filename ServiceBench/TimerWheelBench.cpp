@@ -0,0 +1,146 @@
+#include "Bench.h"
+#include "TimerWheel.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+
+namespace {
+    void Throughput(size_t count) {
+        std::mt19937 random(42);
+        // Long enough that nothing fires while measuring, and spread over
+        // all levels of the wheel.
+        std::uniform_int_distribution<DWORD> delay(1000, 600000);
+        std::vector<DWORD> delays(count);
+        for (DWORD& value : delays) {
+            value = delay(random);
+        }
+        std::vector<TimerWheel::TimerId> ids(count);
+
+        TimerWheel wheel;
+        // Starts the driver thread outside of the measurement.
+        wheel.Cancel(wheel.Schedule(1000, [] {}));
+
+        double start = NowUs();
+        for (size_t i = 0; i < count; ++i) {
+            ids[i] = wheel.Schedule(delays[i], [] {});
+        }
+        const double scheduleUs = NowUs() - start;
+
+        start = NowUs();
+        for (size_t i = 0; i < count; ++i) {
+            wheel.Cancel(ids[i]);
+        }
+        const double cancelUs = NowUs() - start;
+
+        // Request timeouts are mostly cancelled right after being armed.
+        start = NowUs();
+        for (size_t i = 0; i < count; ++i) {
+            wheel.Cancel(wheel.Schedule(delays[i], [] {}));
+        }
+        const double churnUs = NowUs() - start;
+
+        printf("%-44s %8.1f ns/op %8.2f M/s\n", "schedule",
+            scheduleUs * 1000 / count, count / scheduleUs);
+        printf("%-44s %8.1f ns/op %8.2f M/s\n", "cancel",
+            cancelUs * 1000 / count, count / cancelUs);
+        printf("%-44s %8.1f ns/op %8.2f M/s\n", "schedule+cancel",
+            churnUs * 1000 / count, count / churnUs);
+    }
+
+    // Time from the deadline of one-shot timers to their callback. Returns
+    // false if some of them never fired.
+    bool OneShotJitter(DWORD tickMs, size_t count) {
+        std::vector<double> lateUs(count);
+        std::vector<char> fired(count, 0);
+        std::atomic<size_t> remaining(count);
+        HANDLE done = ::CreateEventW(nullptr, TRUE, FALSE, nullptr);
+
+        std::mt19937 random(7);
+        std::uniform_int_distribution<DWORD> delay(0, 2000);
+
+        TimerWheel wheel(tickMs);
+        for (size_t i = 0; i < count; ++i) {
+            const DWORD delayMs = delay(random);
+            const double due = NowUs() + delayMs * 1000.0;
+            wheel.Schedule(delayMs, [&lateUs, &fired, &remaining, done, i, due] {
+                lateUs[i] = NowUs() - due;
+                fired[i] = 1;
+                if (--remaining == 0) {
+                    ::SetEvent(done);
+                }
+            });
+        }
+
+        const bool allFired = ::WaitForSingleObject(done, 30000) == WAIT_OBJECT_0;
+        // Waits for running callbacks, so |fired| is stable afterwards.
+        wheel.Stop();
+        ::CloseHandle(done);
+
+        // Timers that never fired have no lateness to report.
+        std::vector<double> firedLateUs;
+        for (size_t i = 0; i < count; ++i) {
+            if (fired[i]) {
+                firedLateUs.push_back(lateUs[i]);
+            }
+        }
+
+        char label[64];
+        sprintf_s(label, "one-shot late, tick %lums", tickMs);
+        PrintLatencies(label, firedLateUs);
+        if (!allFired) {
+            printf("%zu of %zu one-shot timers didn't fire\n",
+                count - firedLateUs.size(), count);
+        }
+        return allFired;
+    }
+
+    // Deviation of the interval between two runs of a periodic timer.
+    void PeriodicJitter(DWORD tickMs, DWORD periodMs, DWORD durationMs) {
+        std::vector<double> firedUs(durationMs / periodMs + 64);
+        std::atomic<size_t> fired(0);
+
+        TimerWheel wheel(tickMs);
+        wheel.Schedule(periodMs, [&firedUs, &fired] {
+            const size_t index = fired++;
+            if (index < firedUs.size()) {
+                firedUs[index] = NowUs();
+            }
+        }, periodMs);
+        ::Sleep(durationMs);
+        wheel.Stop();
+
+        firedUs.resize(fired < firedUs.size() ? fired.load() : firedUs.size());
+        std::sort(firedUs.begin(), firedUs.end());
+
+        std::vector<double> deviationUs;
+        for (size_t i = 1; i < firedUs.size(); ++i) {
+            deviationUs.push_back(std::abs(firedUs[i] - firedUs[i - 1] - periodMs * 1000.0));
+        }
+
+        char label[64];
+        sprintf_s(label, "periodic %lums, tick %lums", periodMs, tickMs);
+        PrintLatencies(label, deviationUs);
+    }
+}
+
+int RunTimerWheelBench(int argc, wchar_t* argv[]) {
+    const size_t count = argc > 0 ? wcstoul(argv[0], nullptr, 10) : 1000000;
+    if (count == 0) {
+        printf("Usage: ServiceBench timers [count]\n");
+        return 2;
+    }
+
+    Throughput(count);
+    bool allFired = true;
+    for (DWORD tickMs : { 1, 10 }) {
+        if (!OneShotJitter(tickMs, 5000)) {
+            allFired = false;
+        }
+        PeriodicJitter(tickMs, 10, 3000);
+    }
+    return allFired ? 0 : 1;
+}
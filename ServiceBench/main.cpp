@@ -0,0 +1,62 @@
+#include "Bench.h"
+
+#include <cstdio>
+#include <cwchar>
+
+namespace {
+    struct Benchmark {
+        const wchar_t* name;
+        int (*run)(int argc, wchar_t* argv[]);
+        const char* description;
+        // Run when no benchmark is named.
+        bool byDefault;
+    };
+
+    const Benchmark kBenchmarks[] = {
+        { L"timers", RunTimerWheelBench,
+            "TimerWheel schedule/cancel throughput and firing jitter", true },
+        { L"coldstart", RunColdStartBench,
+            "First request latency of an activated service, idle-stop", true },
+        { L"replay", RunReplayBench,
+            "Replays a control trace: replay <trace> [--realtime]", false },
+        { L"storm", RunStormBench,
+            "Concurrent control storm, checks transitions: storm [seconds] [threads]", true },
+        { L"handoff", RunHandoffBench,
+            "Request gap while standbys take over: handoff [rollouts]", true },
+        { L"overload", RunOverloadBench,
+            "Goodput and latency at 2x load with and without the limiter", true },
+    };
+
+    void PrintUsage() {
+        printf("Usage: ServiceBench [name [options]]\n"
+            "Runs the default benchmarks when no name is given.\n\n");
+        for (const Benchmark& benchmark : kBenchmarks) {
+            printf("  %-10ls %s\n", benchmark.name, benchmark.description);
+        }
+    }
+}
+
+int wmain(int argc, wchar_t* argv[]) {
+    if (argc < 2) {
+        int result = 0;
+        for (const Benchmark& benchmark : kBenchmarks) {
+            if (!benchmark.byDefault) {
+                continue;
+            }
+            printf("== %ls\n", benchmark.name);
+            if (benchmark.run(0, nullptr) != 0) {
+                result = 1;
+            }
+        }
+        return result;
+    }
+
+    for (const Benchmark& benchmark : kBenchmarks) {
+        if (wcscmp(argv[1], benchmark.name) == 0) {
+            return benchmark.run(argc - 2, argv + 2);
+        }
+    }
+
+    PrintUsage();
+    return 2;
+}
@@ -0,0 +1,38 @@
+#include "pch.h"
+#include "ServiceDriver.h"
+#include "Service_Base.h"
+
+ServiceDriver::ServiceDriver(ServiceBase& service)
+    : m_service(service),
+    m_previous(ServiceBase::m_service) {
+    // The control handler of the service is static and finds it there.
+    ServiceBase::m_service = &service;
+}
+
+ServiceDriver::~ServiceDriver() {
+    SetStatusObserver(nullptr);
+    ServiceBase::m_service = m_previous;
+}
+
+void ServiceDriver::Start(DWORD argc, wchar_t* argv[]) {
+    m_service.m_recorder.Record(ControlRecorder::kStartCode, 0, nullptr);
+    m_service.Start(argc, argv);
+}
+
+void ServiceDriver::Control(DWORD ctrlCode, DWORD evtType, void* evtData) {
+    ServiceBase::ServiceCtrlHandler(ctrlCode, evtType, evtData, nullptr);
+}
+
+DWORD ServiceDriver::GetState() const {
+    return m_service.GetState();
+}
+
+void ServiceDriver::SetStatusObserver(StatusObserver observer) {
+    std::lock_guard<std::mutex> lock(m_service.m_statusLock);
+    m_service.m_statusObserver = std::move(observer);
+}
+
+// static
+bool ServiceDriver::IsLegalTransition(DWORD from, DWORD to, DWORD errCode) {
+    return ServiceBase::IsLegalTransition(from, to, errCode);
+}
@@ -0,0 +1,45 @@
+#ifndef SERVICE_DRIVER_H_
+#define SERVICE_DRIVER_H_
+
+#include <windows.h>
+#include <functional>
+
+class ServiceBase;
+
+// Stand-in for the SCM. Delivers the start and control requests the SCM
+// would, without registering the service, so it can be run and measured
+// from any process. Only one driver may be active in a process at a time.
+class ServiceDriver {
+public:
+    typedef std::function<void(DWORD from, DWORD to, DWORD errCode)> StatusObserver;
+
+    explicit ServiceDriver(ServiceBase& service);
+    ~ServiceDriver();
+
+    ServiceDriver(const ServiceDriver& other) = delete;
+    ServiceDriver& operator=(const ServiceDriver& other) = delete;
+
+    // Runs the start sequence on the calling thread, like the SCM does on the
+    // thread it calls the service main function on.
+    void Start(DWORD argc, wchar_t* argv[]);
+
+    // Delivers a request through the control handler of the service.
+    void Control(DWORD ctrlCode, DWORD evtType = 0, void* evtData = nullptr);
+
+    DWORD GetState() const;
+
+    // Called for every status the service reports, on the thread reporting
+    // it and in the order the SCM would see them. The observer must not call
+    // back into the service. Set it before Start() to see every state.
+    void SetStatusObserver(StatusObserver observer);
+
+    // Whether the SCM accepts a service going from |from| to |to| while
+    // reporting |errCode|.
+    static bool IsLegalTransition(DWORD from, DWORD to, DWORD errCode);
+
+private:
+    ServiceBase& m_service;
+    ServiceBase* m_previous;
+};
+
+#endif // SERVICE_DRIVER_H_
@@ -4,6 +4,7 @@
 #include <Windows.h>
 #include <string.h>
 #include <iostream>
+#include <vector>
 
 namespace {
     class ServiceHandle {
@@ -24,23 +25,180 @@ namespace {
     private:
         SC_HANDLE m_handle = nullptr;
     };
+
+    const DWORD kRestartActionCount = 10;
+    const DWORD kRestartResetPeriod = 86400;
+
+    // Quoted path of the running executable, as registered with the SCM.
+    bool GetEscapedModulePath(std::wstring& path) {
+        wchar_t modulePath[MAX_PATH];
+
+        if (::GetModuleFileNameW(nullptr, modulePath, MAX_PATH) == 0) {
+            printf(("Couldn't get module file name: %d\n"), ::GetLastError());
+            return false;
+        }
+
+        path = modulePath;
+        if (modulePath[0] != L'\"') {
+            path = L'\"' + path + L'\"';
+        }
+        return true;
+    }
+
+    // Restart policy used by AutoRestart(): exponential back-off, reset daily.
+    void FillRestartActions(SERVICE_FAILURE_ACTIONSW& sfa,
+        SC_ACTION (&actions)[kRestartActionCount]) {
+        sfa.dwResetPeriod = kRestartResetPeriod;
+        sfa.lpCommand = nullptr;
+        sfa.lpRebootMsg = nullptr;
+        sfa.cActions = kRestartActionCount;
+        sfa.lpsaActions = actions;
+
+        for (DWORD i = 0; i < kRestartActionCount; i++) {
+            actions[i].Type = SC_ACTION_RESTART;
+            actions[i].Delay = 256 << i;
+        }
+    }
+
+    bool SameFailureActions(const SERVICE_FAILURE_ACTIONSW& lhs,
+        const SERVICE_FAILURE_ACTIONSW& rhs) {
+        if (lhs.dwResetPeriod != rhs.dwResetPeriod || lhs.cActions != rhs.cActions) {
+            return false;
+        }
+        for (DWORD i = 0; i < lhs.cActions; i++) {
+            if (lhs.lpsaActions[i].Type != rhs.lpsaActions[i].Type ||
+                lhs.lpsaActions[i].Delay != rhs.lpsaActions[i].Delay) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Dependencies as a list of names separated by L'\0', without the
+    // terminating double null. Short values are treated as "no dependencies"
+    // the same way Install() does.
+    std::wstring NormalizeDependencies(const std::wstring& depends) {
+        if (depends.length() <= 2) {
+            return std::wstring();
+        }
+        std::wstring result(depends);
+        while (!result.empty() && result.back() == L'\0') {
+            result.pop_back();
+        }
+        return result;
+    }
+
+    std::wstring MultiSzToString(const wchar_t* multiSz) {
+        std::wstring result;
+        if (!multiSz) {
+            return result;
+        }
+        while (*multiSz) {
+            if (!result.empty()) {
+                result += L'\0';
+            }
+            result += multiSz;
+            multiSz += wcslen(multiSz) + 1;
+        }
+        return result;
+    }
+
+    // Native SERVICE_TRIGGER_INFO built from the triggers of a service.
+    class TriggerInfo {
+    public:
+        explicit TriggerInfo(const std::vector<ServiceTrigger>& triggers)
+            : m_subtypes(triggers.size()),
+            m_data(triggers.size()),
+            m_items(triggers.size()),
+            m_triggers(triggers.size()) {
+            for (size_t i = 0; i < triggers.size(); i++) {
+                m_subtypes[i] = triggers[i].subtype;
+                // Data strings are passed as a double null terminated list.
+                m_data[i] = triggers[i].data + L'\0';
+
+                SERVICE_TRIGGER_SPECIFIC_DATA_ITEM& item = m_items[i];
+                item.dwDataType = SERVICE_TRIGGER_DATA_TYPE_STRING;
+                item.cbData = static_cast<DWORD>((m_data[i].size() + 1) * sizeof(wchar_t));
+                item.pData = reinterpret_cast<PBYTE>(&m_data[i][0]);
+
+                SERVICE_TRIGGER& trigger = m_triggers[i];
+                trigger.dwTriggerType = triggers[i].type;
+                trigger.dwAction = triggers[i].action;
+                trigger.pTriggerSubtype = &m_subtypes[i];
+                trigger.cDataItems = triggers[i].data.empty() ? 0 : 1;
+                trigger.pDataItems = triggers[i].data.empty() ? nullptr : &item;
+            }
+
+            m_info.cTriggers = static_cast<DWORD>(m_triggers.size());
+            m_info.pTriggers = m_triggers.empty() ? nullptr : m_triggers.data();
+            m_info.pReserved = nullptr;
+        }
+
+        TriggerInfo(const TriggerInfo& other) = delete;
+        TriggerInfo& operator=(const TriggerInfo& other) = delete;
+
+        SERVICE_TRIGGER_INFO* Get() {
+            return &m_info;
+        }
+
+    private:
+        std::vector<GUID> m_subtypes;
+        std::vector<std::wstring> m_data;
+        std::vector<SERVICE_TRIGGER_SPECIFIC_DATA_ITEM> m_items;
+        std::vector<SERVICE_TRIGGER> m_triggers;
+        SERVICE_TRIGGER_INFO m_info;
+    };
+
+    bool SameTriggers(const SERVICE_TRIGGER_INFO& lhs, const SERVICE_TRIGGER_INFO& rhs) {
+        if (lhs.cTriggers != rhs.cTriggers) {
+            return false;
+        }
+        for (DWORD i = 0; i < lhs.cTriggers; i++) {
+            const SERVICE_TRIGGER& left = lhs.pTriggers[i];
+            const SERVICE_TRIGGER& right = rhs.pTriggers[i];
+            if (left.dwTriggerType != right.dwTriggerType ||
+                left.dwAction != right.dwAction ||
+                !left.pTriggerSubtype || !right.pTriggerSubtype ||
+                !IsEqualGUID(*left.pTriggerSubtype, *right.pTriggerSubtype) ||
+                left.cDataItems != right.cDataItems) {
+                return false;
+            }
+            for (DWORD j = 0; j < left.cDataItems; j++) {
+                const SERVICE_TRIGGER_SPECIFIC_DATA_ITEM& a = left.pDataItems[j];
+                const SERVICE_TRIGGER_SPECIFIC_DATA_ITEM& b = right.pDataItems[j];
+                if (a.dwDataType != b.dwDataType || a.cbData != b.cbData ||
+                    memcmp(a.pData, b.pData, a.cbData) != 0) {
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+
+    bool WriteTriggers(SC_HANDLE servHandle, const ServiceBase& service) {
+        TriggerInfo triggers(service.GetTriggers());
+        if (!::ChangeServiceConfig2W(servHandle, SERVICE_CONFIG_TRIGGER_INFO,
+            triggers.Get())) {
+            printf("Couldn't set service triggers: %d\n", ::GetLastError());
+            return false;
+        }
+        return true;
+    }
+
+    // Install() passes no account for short values, which the SCM stores as
+    // LocalSystem.
+    std::wstring EffectiveAccount(const std::wstring& account) {
+        return account.length() <= 2 ? std::wstring(L"LocalSystem") : account;
+    }
 }
 
 //static
 bool ServiceInstaller::Install(const ServiceBase& service)
 {
-    wchar_t modulePath[MAX_PATH];
-
-    if (::GetModuleFileNameW(nullptr, modulePath, MAX_PATH) == 0) {
-        printf(("Couldn't get module file name: %d\n"), ::GetLastError());
+    std::wstring escapedPath;
+    if (!GetEscapedModulePath(escapedPath)) {
         return false;
     }
-
-    std::wstring escapedPath(modulePath);
-    if (modulePath[0] != L'\"')
-    {
-        escapedPath = L'\"' + escapedPath + L'\"';
-    }
     wchar_t* bin = (wchar_t*)escapedPath.c_str();
 
     std::wcout << L"bin = " << bin << L"\n";
@@ -59,7 +217,7 @@ bool ServiceInstaller::Install(const ServiceBase& service)
     ServiceHandle servHandle = ::CreateServiceW(svcControlManager,
         service.GetName().c_str(),
         service.GetDisplayName().c_str(),
-        SERVICE_QUERY_STATUS,
+        SERVICE_QUERY_STATUS | SERVICE_CHANGE_CONFIG | DELETE,
         SERVICE_WIN32_OWN_PROCESS,
         service.GetStartType(),
         service.GetErrorControlType(),
@@ -74,11 +232,207 @@ bool ServiceInstaller::Install(const ServiceBase& service)
         printf("Couldn't create service: %d\n", ::GetLastError());
         return false;
     }
+    if (!service.GetTriggers().empty() && !WriteTriggers(servHandle, service)) {
+        // A demand-start service without its triggers would never start, so
+        // don't leave it installed.
+        if (!::DeleteService(servHandle)) {
+            printf("Couldn't delete partially installed service: %d\n", ::GetLastError());
+        }
+        return false;
+    }
     CloseServiceHandle(servHandle);
     CloseServiceHandle(svcControlManager);
     return true;
 }
 
+//static
+bool ServiceInstaller::Apply(const ServiceBase& service, bool autoRestart,
+    DWORD* changes, bool reconcileTriggers) {
+    DWORD changed = ChangeNone;
+    if (changes) {
+        *changes = ChangeNone;
+    }
+
+    ServiceHandle svcControlManager = ::OpenSCManagerW(nullptr, nullptr,
+        SC_MANAGER_CONNECT);
+    if (!svcControlManager) {
+        printf("Couldn't open service control manager: %d\n", ::GetLastError());
+        return false;
+    }
+
+    DWORD access = SERVICE_QUERY_CONFIG | SERVICE_CHANGE_CONFIG;
+    if (autoRestart) {
+        // Restart actions can only be configured with SERVICE_START access.
+        access |= SERVICE_START;
+    }
+
+    ServiceHandle servHandle = ::OpenServiceW(svcControlManager,
+        service.GetName().c_str(), access);
+    if (!servHandle) {
+        if (::GetLastError() != ERROR_SERVICE_DOES_NOT_EXIST) {
+            printf("OpenService failed (%d)\n", ::GetLastError());
+            return false;
+        }
+
+        if (!Install(service)) {
+            return false;
+        }
+        changed |= ChangeCreated;
+        if (autoRestart) {
+            if (!AutoRestart(service)) {
+                return false;
+            }
+            changed |= ChangeFailureActions;
+        }
+        if (changes) {
+            *changes = changed;
+        }
+        return true;
+    }
+
+    // The documented maximum size of the config is 8K, so this is normally
+    // the only query needed.
+    std::vector<BYTE> buffer(8 * 1024);
+    DWORD bytesNeeded = 0;
+    while (!::QueryServiceConfigW(servHandle,
+        reinterpret_cast<LPQUERY_SERVICE_CONFIGW>(buffer.data()),
+        static_cast<DWORD>(buffer.size()), &bytesNeeded)) {
+        if (::GetLastError() != ERROR_INSUFFICIENT_BUFFER) {
+            printf("QueryServiceConfig failed (%d)\n", ::GetLastError());
+            return false;
+        }
+        buffer.resize(bytesNeeded);
+    }
+    const QUERY_SERVICE_CONFIGW* current =
+        reinterpret_cast<const QUERY_SERVICE_CONFIGW*>(buffer.data());
+
+    std::wstring binaryPath;
+    if (!GetEscapedModulePath(binaryPath)) {
+        return false;
+    }
+    const std::wstring depends = NormalizeDependencies(service.GetDependencies());
+    const std::wstring account = EffectiveAccount(service.GetAccount());
+
+    DWORD startType = SERVICE_NO_CHANGE;
+    DWORD errorControl = SERVICE_NO_CHANGE;
+    const wchar_t* newBinaryPath = nullptr;
+    const wchar_t* newDepends = nullptr;
+    const wchar_t* newAccount = nullptr;
+    const wchar_t* newPassword = nullptr;
+    const wchar_t* newDisplayName = nullptr;
+
+    // Dependencies are passed to the SCM as a double null terminated list.
+    const std::wstring dependsMultiSz = depends + L'\0';
+
+    if (current->dwStartType != service.GetStartType()) {
+        startType = service.GetStartType();
+        changed |= ChangeStartType;
+    }
+    if (current->dwErrorControl != service.GetErrorControlType()) {
+        errorControl = service.GetErrorControlType();
+        changed |= ChangeErrorControl;
+    }
+    if (!current->lpBinaryPathName ||
+        _wcsicmp(current->lpBinaryPathName, binaryPath.c_str()) != 0) {
+        newBinaryPath = binaryPath.c_str();
+        changed |= ChangeBinaryPath;
+    }
+    if (MultiSzToString(current->lpDependencies) != depends) {
+        newDepends = dependsMultiSz.c_str();
+        changed |= ChangeDependencies;
+    }
+    // The password can't be read back, so it is only sent along with an
+    // account change.
+    if (!current->lpServiceStartName ||
+        _wcsicmp(current->lpServiceStartName, account.c_str()) != 0) {
+        newAccount = account.c_str();
+        const std::wstring& pass = service.GetPassword();
+        newPassword = (pass.length() <= 2 ? L"" : pass.c_str());
+        changed |= ChangeAccount;
+    }
+    if (!current->lpDisplayName ||
+        service.GetDisplayName() != current->lpDisplayName) {
+        newDisplayName = service.GetDisplayName().c_str();
+        changed |= ChangeDisplayName;
+    }
+
+    if (changed != ChangeNone &&
+        !::ChangeServiceConfigW(servHandle,
+            SERVICE_NO_CHANGE,
+            startType,
+            errorControl,
+            newBinaryPath,
+            nullptr,
+            nullptr,
+            newDepends,
+            newAccount,
+            newPassword,
+            newDisplayName)) {
+        printf("ChangeServiceConfig failed (%d)\n", ::GetLastError());
+        return false;
+    }
+
+    if (autoRestart) {
+        SERVICE_FAILURE_ACTIONSW wanted;
+        SC_ACTION actions[kRestartActionCount];
+        FillRestartActions(wanted, actions);
+
+        std::vector<BYTE> actionsBuffer(sizeof(SERVICE_FAILURE_ACTIONSW) +
+            sizeof(actions) + 1024);
+        while (!::QueryServiceConfig2W(servHandle, SERVICE_CONFIG_FAILURE_ACTIONS,
+            actionsBuffer.data(), static_cast<DWORD>(actionsBuffer.size()),
+            &bytesNeeded)) {
+            if (::GetLastError() != ERROR_INSUFFICIENT_BUFFER) {
+                printf("QueryServiceConfig2 failed (%d)\n", ::GetLastError());
+                return false;
+            }
+            actionsBuffer.resize(bytesNeeded);
+        }
+
+        if (!SameFailureActions(*reinterpret_cast<const SERVICE_FAILURE_ACTIONSW*>(
+            actionsBuffer.data()), wanted)) {
+            if (!::ChangeServiceConfig2W(servHandle, SERVICE_CONFIG_FAILURE_ACTIONS,
+                &wanted)) {
+                printf("Couldn't active auto restart: %d\n", ::GetLastError());
+                return false;
+            }
+            changed |= ChangeFailureActions;
+        }
+    }
+
+    if (reconcileTriggers) {
+        // An empty set is reconciled too, which removes installed triggers.
+        TriggerInfo triggers(service.GetTriggers());
+
+        std::vector<BYTE> triggerBuffer(1024);
+        while (!::QueryServiceConfig2W(servHandle, SERVICE_CONFIG_TRIGGER_INFO,
+            triggerBuffer.data(), static_cast<DWORD>(triggerBuffer.size()),
+            &bytesNeeded)) {
+            if (::GetLastError() != ERROR_INSUFFICIENT_BUFFER) {
+                printf("QueryServiceConfig2 failed (%d)\n", ::GetLastError());
+                return false;
+            }
+            triggerBuffer.resize(bytesNeeded);
+        }
+
+        if (!SameTriggers(*reinterpret_cast<const SERVICE_TRIGGER_INFO*>(
+            triggerBuffer.data()), *triggers.Get())) {
+            if (!WriteTriggers(servHandle, service)) {
+                return false;
+            }
+            changed |= ChangeTriggers;
+        }
+    }
+
+    if (changed == ChangeNone) {
+        printf("Service configuration is up to date\n");
+    }
+    if (changes) {
+        *changes = changed;
+    }
+    return true;
+}
+
 //static
 bool ServiceInstaller::Uninstall(const ServiceBase& service) {
     ServiceHandle svcControlManager = ::OpenSCManagerW(nullptr, nullptr,
@@ -156,20 +510,9 @@ bool ServiceInstaller::AutoRestart(const ServiceBase& service)
     }
 
 
-    SERVICE_FAILURE_ACTIONS sfa;
-    SC_ACTION actions[10];
-
-    sfa.dwResetPeriod = 86400;
-    sfa.lpCommand = NULL;
-    sfa.lpRebootMsg = NULL;
-    sfa.cActions = 10;
-    sfa.lpsaActions = actions;
-
-    for (int i = 0; i < 10; i++)
-    {
-        sfa.lpsaActions[i].Type = SC_ACTION_RESTART;
-        sfa.lpsaActions[i].Delay = 256 << i;
-    }
+    SERVICE_FAILURE_ACTIONSW sfa;
+    SC_ACTION actions[kRestartActionCount];
+    FillRestartActions(sfa, actions);
 
     if (ChangeServiceConfig2W(schService, SERVICE_CONFIG_FAILURE_ACTIONS, &sfa) == 0)
     {
@@ -182,6 +525,25 @@ bool ServiceInstaller::AutoRestart(const ServiceBase& service)
     return true;
 }
 
+//static
+bool ServiceInstaller::SetTriggers(const ServiceBase& service) {
+    ServiceHandle svcControlManager = ::OpenSCManagerW(nullptr, nullptr,
+        SC_MANAGER_CONNECT);
+    if (!svcControlManager) {
+        printf("Couldn't open service control manager: %d\n", ::GetLastError());
+        return false;
+    }
+
+    ServiceHandle servHandle = ::OpenServiceW(svcControlManager,
+        service.GetName().c_str(), SERVICE_CHANGE_CONFIG);
+    if (!servHandle) {
+        printf("OpenService failed (%d)\n", ::GetLastError());
+        return false;
+    }
+
+    return WriteTriggers(servHandle, service);
+}
+
 bool ServiceInstaller::DoStartSvc(const ServiceBase& service)
 {
     SERVICE_STATUS_PROCESS ssStatus;
@@ -5,11 +5,40 @@
 
 class ServiceInstaller {
 public:
+	// Flags reported by Apply() describing which settings were changed.
+	enum ConfigChange : DWORD {
+		ChangeNone = 0,
+		ChangeCreated = 1 << 0,
+		ChangeDisplayName = 1 << 1,
+		ChangeStartType = 1 << 2,
+		ChangeErrorControl = 1 << 3,
+		ChangeBinaryPath = 1 << 4,
+		ChangeDependencies = 1 << 5,
+		ChangeAccount = 1 << 6,
+		ChangeFailureActions = 1 << 7,
+		ChangeTriggers = 1 << 8,
+	};
+
 	static bool Install(const ServiceBase& service);
+
+	// Installs the service if it doesn't exist, otherwise reconfigures only the
+	// settings that differ from |service| without stopping it. When |autoRestart|
+	// is set the failure actions are reconciled against the AutoRestart() policy.
+	// When |reconcileTriggers| is set the installed triggers are replaced by
+	// the declared ones, so triggers of a service that no longer declares
+	// any are removed. An up to date service costs one QueryServiceConfigW(),
+	// plus one QueryServiceConfig2W() for each optional setting reconciled.
+	// |changes| receives a combination of ConfigChange flags.
+	static bool Apply(const ServiceBase& service, bool autoRestart = false,
+		DWORD* changes = nullptr, bool reconcileTriggers = false);
 	static bool Uninstall(const ServiceBase& service);
 	static bool DoStartSvc(const ServiceBase& service);
 	static bool DoStopSvc(const ServiceBase& service);
 	static bool AutoRestart(const ServiceBase& service);
+
+	// Replaces the start triggers of an installed service with the ones
+	// declared by |service|. Removes them all if it declares none.
+	static bool SetTriggers(const ServiceBase& service);
 private:
 	ServiceInstaller() {}
 };
@@ -1,8 +1,34 @@
 #ifndef SERVICE_BASE_H_
 #define SERVICE_BASE_H_
 
+// Before windows.h, which pulls in winsock.h otherwise unless
+// WIN32_LEAN_AND_MEAN is defined, so Handoff.h can still be included later.
+#include <winsock2.h>
 #include <windows.h>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <vector>
+
+#include "ConcurrencyLimiter.h"
+#include "ControlTrace.h"
+#include "TimerWheel.h"
+
+// See Handoff.h, only services that hand off need to include it.
+struct HandoffState;
+class HandoffChannel;
+
+// Event that makes the SCM start or stop a demand-start service.
+struct ServiceTrigger {
+    DWORD type;
+    GUID subtype;
+    DWORD action;
+    // Strings separated by L'\0', empty if the trigger type takes no data.
+    std::wstring data;
+};
 
 // Base Service class used to create windows services.
 class ServiceBase {
@@ -13,13 +39,29 @@ public:
     ServiceBase(ServiceBase&& other) = delete;
     ServiceBase& operator=(ServiceBase&& other) = delete;
 
-    virtual ~ServiceBase() {}
+    virtual ~ServiceBase();
 
     // Called by windows when starting the service.
     bool Run() {
         return RunInternal(this);
     }
 
+    // Runs a new binary as standby for the running service: warms up with
+    // OnStandby(), takes over the sockets and state of the instance serving
+    // now through the host, the instance the SCM started, then serves until
+    // the host forwards a stop or hands off to the next standby. The SCM
+    // keeps seeing the host as SERVICE_RUNNING. The standby must run under
+    // the account of the service. Exit with a zero code when this returns
+    // true, the host reports any other exit code as a service failure.
+    bool RunStandby(DWORD argc, wchar_t* argv[]);
+
+    // Records the control requests received from now on into a new trace
+    // named after |path|, see ControlRecorder::Open() and ControlReplayer.
+    // Call before Run().
+    bool RecordControls(const std::wstring& path) {
+        return m_recorder.Open(path);
+    }
+
     const std::wstring& GetName() const {
         return m_name;
     }
@@ -31,6 +73,18 @@ public:
     // Account info service runs under.
     const std::wstring& GetAccount() const { return m_account; }
     const std::wstring& GetPassword() const { return m_password; }
+
+    // Current state as last reported to the SCM.
+    DWORD GetState() const;
+
+    // Triggers installed with the service.
+    const std::vector<ServiceTrigger>& GetTriggers() const { return m_triggers; }
+
+    // Reports work so the idle timeout doesn't stop the service. Use
+    // Begin/EndActivity around work that may outlast the timeout.
+    void NotifyActivity();
+    void BeginActivity();
+    void EndActivity();
 protected:
     ServiceBase(const std::wstring& name,
         const std::wstring& displayName,
@@ -43,6 +97,37 @@ protected:
 
     void SetStatus(DWORD dwState, DWORD dwErrCode = NO_ERROR, DWORD dwWait = 0);
 
+    // Lets the SCM start the service on demand, e.g. when a port or a named
+    // pipe is opened. Use with SERVICE_DEMAND_START.
+    void AddTrigger(DWORD type, const GUID& subtype,
+        const std::wstring& data = (L""),
+        DWORD action = SERVICE_TRIGGER_ACTION_SERVICE_START);
+
+    // Stops the service after |idleMs| without activity. Zero disables it.
+    void SetIdleTimeout(DWORD idleMs) { m_idleTimeout = idleMs; }
+
+    // Lets a standby instance take over while the service is running. This
+    // instance stays the host: it forwards SCM controls to the instance
+    // serving and relays later handoffs to it, so previous instances exit.
+    // The idle timeout only applies to the instance serving.
+    void EnableHandoff() { m_handoffEnabled = true; }
+
+    // Admission control for incoming work. Call Acquire() before handling a
+    // request and Release() with its latency afterwards.
+    ConcurrencyLimiter& GetLimiter() { return m_limiter; }
+
+    // Reports SERVICE_PAUSED while the limiter is overloaded and
+    // SERVICE_RUNNING once latency recovers, or once requests stop coming
+    // in, see ConcurrencyLimiter::Refresh(). Work keeps being admitted at
+    // the reduced limit meanwhile, and OnOverload() is called instead of
+    // OnPause()/OnContinue(). An operator continue ends the pause early, an
+    // operator pause takes it over after OnOverload(false).
+    void EnableOverloadPause();
+
+    // Timers for periodic work. They are suspended while the service is
+    // paused by the SCM and cancelled when it stops.
+    TimerWheel& GetTimers() { return m_timers; }
+
     // Overro=ide these functions as you need.
     virtual void OnStart(DWORD argc, wchar_t* argv[]) = 0;
     virtual void OnStop() {}
@@ -51,7 +136,20 @@ protected:
     virtual void OnShutdown() {}
     virtual void OnSessionChange(DWORD /*evtType*/,
         WTSSESSION_NOTIFICATION* /*notification*/) {}
+
+    virtual void OnOverload(bool /*overloaded*/) {}
+
+    // Handoff, see EnableHandoff() and RunStandby(). The instance serving
+    // exports its sockets and state in OnHandoff() and keeps serving until
+    // OnHandoffComplete(), after which it stops serving. The standby warms
+    // up in OnStandby() and starts serving in OnTakeover().
+    virtual bool OnHandoff(HandoffState& /*state*/) { return false; }
+    virtual void OnHandoffComplete() {}
+    virtual void OnStandby(DWORD /*argc*/, wchar_t* /*argv*/[]) {}
+    virtual bool OnTakeover(const HandoffState& /*state*/) { return false; }
 private:
+    friend class ServiceDriver;
+
     // Registers handle and starts the service.
     static void WINAPI SvcMain(DWORD argc, TCHAR* argv[]);
 
@@ -67,6 +165,30 @@ private:
     void Continue();
     void Shutdown();
 
+    // Expect m_transitionLock to be held.
+    void StopLocked();
+
+    static bool IsLegalTransition(DWORD from, DWORD to, DWORD errCode);
+
+    void StartHandoffListener();
+    void StopHandoffListener();
+    void HandoffLoop();
+    bool LockForHandoff(std::unique_lock<std::mutex>& lock);
+    bool HandOff(std::unique_ptr<HandoffChannel>& standby);
+    bool RelayHandoff(std::unique_ptr<HandoffChannel>& standby);
+    // Expect m_transitionLock to be held.
+    void AdoptWorker();
+    void ReleaseWorker();
+    void WorkerExited();
+    void ForwardControl(DWORD ctrlCode);
+    bool ExportTo(DWORD standbyPid);
+
+    void RequestOverloadCheck(DWORD delayMs);
+    void ApplyOverloadState();
+
+    void ArmIdleTimer(DWORD delayMs);
+    void CheckIdle();
+
     std::wstring m_name;
     std::wstring m_displayName;
     DWORD m_dwStartType;
@@ -80,8 +202,46 @@ private:
     bool m_hasAcc = false;
     bool m_hasPass = false;
 
+    std::vector<ServiceTrigger> m_triggers;
+
+    DWORD m_idleTimeout = 0;
+    std::atomic<long> m_activeCount{ 0 };
+    std::atomic<ULONGLONG> m_lastActivity{ 0 };
+    std::mutex m_idleLock;
+    TimerWheel::TimerId m_idleTimer = TimerWheel::kInvalidTimer;
+
+    // Serializes Start/Stop/Pause/Continue/Shutdown. Taken before m_statusLock.
+    std::mutex m_transitionLock;
+    // Guards m_svcStatus, which SetStatus() may update from any thread.
+    mutable std::mutex m_statusLock;
+    DWORD m_dwAcceptedCmds;
     SERVICE_STATUS m_svcStatus;
     SERVICE_STATUS_HANDLE m_svcStatusHandle;
+    // Set by a ServiceDriver. Called by SetStatus() with the previous and the
+    // new state and the error code reported, under m_statusLock.
+    std::function<void(DWORD from, DWORD to, DWORD errCode)> m_statusObserver;
+
+    TimerWheel m_timers;
+    ControlRecorder m_recorder;
+
+    ConcurrencyLimiter m_limiter;
+    std::atomic<bool> m_overloadCheckPending{ false };
+    // Set while SERVICE_PAUSED is reported because of overload rather than
+    // an operator request. Guarded by m_transitionLock.
+    bool m_overloadPaused = false;
+
+    bool m_handoffEnabled = false;
+    // Set on the host once another instance serves.
+    std::atomic<bool> m_handedOff{ false };
+    HANDLE m_handoffCancel = nullptr;
+    std::thread m_handoffThread;
+    // Host: channel to the instance serving and its process. The channel is
+    // guarded by m_workerLock, taken after m_transitionLock.
+    std::mutex m_workerLock;
+    std::unique_ptr<HandoffChannel> m_worker;
+    HANDLE m_workerProcess = nullptr;
+    // Standby: channel to the host.
+    std::unique_ptr<HandoffChannel> m_host;
 
     static ServiceBase* m_service;
 };
@@ -0,0 +1,367 @@
+#include "pch.h"
+#include "TimerWheel.h"
+
+#include <algorithm>
+#include <iterator>
+#include <memory>
+
+namespace {
+    // One root wheel of 256 ticks followed by three wheels of 64 slots,
+    // covering 2^26 ticks. Longer delays are re-armed when they come due.
+    const uint32_t kRootBits = 8;
+    const uint32_t kLevelBits = 6;
+    const uint32_t kLevels = 4;
+    const uint32_t kRootSize = 1 << kRootBits;
+    const uint32_t kLevelSize = 1 << kLevelBits;
+    const uint64_t kRootMask = kRootSize - 1;
+    const uint64_t kLevelMask = kLevelSize - 1;
+    const uint64_t kMaxTicks = 1ull << (kRootBits + (kLevels - 1) * kLevelBits);
+
+    // Wheel the callback on the current thread pool thread belongs to.
+    thread_local TimerWheel* t_runningWheel = nullptr;
+
+    uint32_t SlotBase(uint32_t level) {
+        return level == 0 ? 0 : kRootSize + (level - 1) * kLevelSize;
+    }
+
+    uint32_t LevelShift(uint32_t level) {
+        return level == 0 ? 0 : kRootBits + (level - 1) * kLevelBits;
+    }
+}
+
+TimerWheel::TimerWheel(DWORD tickMs)
+    : m_tick(tickMs ? tickMs : 1),
+    m_slots(kRootSize + (kLevels - 1) * kLevelSize, kNil),
+    m_origin(Clock::now()) {
+}
+
+TimerWheel::~TimerWheel() {
+    Stop();
+}
+
+TimerWheel::TimerId TimerWheel::Schedule(DWORD delayMs, Callback callback,
+    DWORD periodMs) {
+    if (!callback) {
+        return kInvalidTimer;
+    }
+
+    std::unique_lock<std::mutex> lock(m_lock);
+    if (m_quit) {
+        // Stop() is in progress.
+        return kInvalidTimer;
+    }
+
+    // Nothing is pending, so skip the idle ticks instead of walking them.
+    if (m_count == 0 && !m_suspended) {
+        m_now = (std::max)(m_now, CurrentTick());
+    }
+
+    const uint32_t index = AllocNode();
+    Node& node = m_nodes[index];
+    node.callback = std::move(callback);
+    node.expires = m_now + ToTicks(delayMs);
+    node.periodTicks = periodMs ? ToTicks(periodMs) : 0;
+    if (periodMs && node.periodTicks == 0) {
+        node.periodTicks = 1;
+    }
+    Link(index);
+
+    const TimerId id = (static_cast<TimerId>(node.generation) << 32) | (index + 1);
+
+    if (!m_driver.joinable()) {
+        m_driver = std::thread(&TimerWheel::DriverLoop, this);
+    }
+    else if (m_count == 1) {
+        m_wakeup.notify_one();
+    }
+    return id;
+}
+
+bool TimerWheel::Cancel(TimerId id) {
+    const uint32_t index = static_cast<uint32_t>(id & 0xFFFFFFFF) - 1;
+    const uint32_t generation = static_cast<uint32_t>(id >> 32);
+
+    std::lock_guard<std::mutex> lock(m_lock);
+    if (id == kInvalidTimer || index >= m_nodes.size()) {
+        return false;
+    }
+
+    Node& node = m_nodes[index];
+    if (node.generation != generation || node.slot == kNil) {
+        return false;
+    }
+
+    Unlink(index);
+    FreeNode(index);
+    return true;
+}
+
+void TimerWheel::Suspend() {
+    std::lock_guard<std::mutex> lock(m_lock);
+    if (!m_suspended) {
+        m_suspended = true;
+        m_suspendedAt = Clock::now();
+    }
+}
+
+void TimerWheel::Resume() {
+    {
+        std::lock_guard<std::mutex> lock(m_lock);
+        if (!m_suspended) {
+            return;
+        }
+        m_suspended = false;
+        m_origin += Clock::now() - m_suspendedAt;
+    }
+    m_wakeup.notify_one();
+}
+
+void TimerWheel::Stop() {
+    {
+        std::lock_guard<std::mutex> lock(m_lock);
+        m_quit = true;
+
+        for (uint32_t index = 0; index < m_nodes.size(); ++index) {
+            if (m_nodes[index].slot != kNil) {
+                m_nodes[index].slot = kNil;
+                FreeNode(index);
+            }
+        }
+        std::fill(m_slots.begin(), m_slots.end(), kNil);
+        m_ready.clear();
+        m_count = 0;
+    }
+    m_wakeup.notify_one();
+
+    // Callbacks never run on the driver thread, so it can't be the caller.
+    if (m_driver.joinable()) {
+        m_driver.join();
+    }
+
+    // A callback may stop the wheel it is running on, so don't wait for it.
+    const long self = (t_runningWheel == this) ? 1 : 0;
+
+    std::unique_lock<std::mutex> lock(m_lock);
+    m_callbacksDone.wait(lock, [this, self] { return m_inFlight <= self; });
+    m_quit = false;
+    m_suspended = false;
+}
+
+size_t TimerWheel::Size() const {
+    std::lock_guard<std::mutex> lock(m_lock);
+    return m_count;
+}
+
+// static
+void CALLBACK TimerWheel::RunCallback(PTP_CALLBACK_INSTANCE /*instance*/,
+    void* context) {
+    std::unique_ptr<Dispatch> dispatch(static_cast<Dispatch*>(context));
+
+    t_runningWheel = dispatch->wheel;
+    dispatch->callback();
+    t_runningWheel = nullptr;
+
+    dispatch->wheel->FinishCallback();
+}
+
+void TimerWheel::DriverLoop() {
+    std::unique_lock<std::mutex> lock(m_lock);
+
+    while (!m_quit) {
+        if (m_ready.empty() && (m_suspended || m_count == 0)) {
+            m_wakeup.wait(lock);
+            continue;
+        }
+
+        const uint64_t target = CurrentTick();
+        while (m_now <= target && m_count != 0) {
+            Advance();
+        }
+        if (m_count == 0) {
+            m_now = target + 1;
+        }
+
+        if (!m_ready.empty()) {
+            std::vector<Callback> ready;
+            ready.swap(m_ready);
+
+            lock.unlock();
+            const size_t submitted = DispatchReady(ready);
+            lock.lock();
+
+            if (submitted < ready.size() && !m_quit) {
+                // The thread pool is out of resources. Retry on the next tick
+                // rather than running callbacks here, which would delay all
+                // other timers and let a callback block the driver.
+                m_ready.insert(m_ready.begin(),
+                    std::make_move_iterator(ready.begin() + submitted),
+                    std::make_move_iterator(ready.end()));
+                m_wakeup.wait_for(lock, m_tick);
+            }
+            continue;
+        }
+
+        m_wakeup.wait_until(lock, m_origin + m_tick * static_cast<long long>(m_now));
+    }
+}
+
+uint64_t TimerWheel::CurrentTick() const {
+    const Clock::time_point now = m_suspended ? m_suspendedAt : Clock::now();
+    return static_cast<uint64_t>((now - m_origin) / m_tick);
+}
+
+uint64_t TimerWheel::ToTicks(DWORD ms) const {
+    const uint64_t tickMs = static_cast<uint64_t>(m_tick.count());
+    return (static_cast<uint64_t>(ms) + tickMs - 1) / tickMs;
+}
+
+uint32_t TimerWheel::AllocNode() {
+    if (m_freeList != kNil) {
+        const uint32_t index = m_freeList;
+        m_freeList = m_nodes[index].next;
+        m_nodes[index].next = kNil;
+        return index;
+    }
+    m_nodes.emplace_back();
+    return static_cast<uint32_t>(m_nodes.size() - 1);
+}
+
+void TimerWheel::FreeNode(uint32_t index) {
+    Node& node = m_nodes[index];
+    node.callback = nullptr;
+    // Invalidates outstanding ids for this node.
+    ++node.generation;
+    node.next = m_freeList;
+    m_freeList = index;
+}
+
+void TimerWheel::Link(uint32_t index) {
+    Node& node = m_nodes[index];
+
+    uint64_t expires = node.expires < m_now ? m_now : node.expires;
+    if (expires - m_now >= kMaxTicks) {
+        expires = m_now + kMaxTicks - 1;
+    }
+
+    const uint64_t delta = expires - m_now;
+    uint32_t level = 0;
+    while (level < kLevels - 1 &&
+        delta >= (1ull << (kRootBits + level * kLevelBits))) {
+        ++level;
+    }
+
+    const uint64_t mask = level == 0 ? kRootMask : kLevelMask;
+    const uint32_t slot = SlotBase(level) +
+        static_cast<uint32_t>((expires >> LevelShift(level)) & mask);
+
+    node.slot = slot;
+    node.prev = kNil;
+    node.next = m_slots[slot];
+    if (node.next != kNil) {
+        m_nodes[node.next].prev = index;
+    }
+    m_slots[slot] = index;
+    ++m_count;
+}
+
+void TimerWheel::Unlink(uint32_t index) {
+    Node& node = m_nodes[index];
+
+    if (node.prev != kNil) {
+        m_nodes[node.prev].next = node.next;
+    }
+    else {
+        m_slots[node.slot] = node.next;
+    }
+    if (node.next != kNil) {
+        m_nodes[node.next].prev = node.prev;
+    }
+
+    node.prev = kNil;
+    node.next = kNil;
+    node.slot = kNil;
+    --m_count;
+}
+
+// Moves every timer of one slot of |level| down to the wheels below it.
+uint32_t TimerWheel::Cascade(uint32_t level, uint32_t index) {
+    const uint32_t slot = SlotBase(level) + index;
+
+    uint32_t current = m_slots[slot];
+    m_slots[slot] = kNil;
+    while (current != kNil) {
+        const uint32_t next = m_nodes[current].next;
+        m_nodes[current].slot = kNil;
+        --m_count;
+        Link(current);
+        current = next;
+    }
+    return index;
+}
+
+void TimerWheel::Advance() {
+    const uint64_t tick = m_now;
+    const uint32_t index = static_cast<uint32_t>(tick & kRootMask);
+
+    if (index == 0) {
+        for (uint32_t level = 1; level < kLevels; ++level) {
+            const uint32_t levelIndex =
+                static_cast<uint32_t>((tick >> LevelShift(level)) & kLevelMask);
+            if (Cascade(level, levelIndex) != 0) {
+                break;
+            }
+        }
+    }
+
+    ++m_now;
+
+    uint32_t current = m_slots[index];
+    m_slots[index] = kNil;
+    while (current != kNil) {
+        Node& node = m_nodes[current];
+        const uint32_t next = node.next;
+        node.slot = kNil;
+        --m_count;
+
+        if (node.expires > tick) {
+            // Delay was longer than the wheel covers.
+            Link(current);
+        }
+        else if (node.periodTicks) {
+            m_ready.push_back(node.callback);
+            node.expires = tick + node.periodTicks;
+            Link(current);
+        }
+        else {
+            m_ready.push_back(std::move(node.callback));
+            FreeNode(current);
+        }
+        current = next;
+    }
+}
+
+// Returns the number of callbacks handed to the thread pool, which stops at
+// the first one it couldn't take. The others are left in |ready|.
+size_t TimerWheel::DispatchReady(std::vector<Callback>& ready) {
+    for (size_t i = 0; i < ready.size(); ++i) {
+        {
+            std::lock_guard<std::mutex> lock(m_lock);
+            ++m_inFlight;
+        }
+
+        std::unique_ptr<Dispatch> dispatch(new Dispatch{ this, std::move(ready[i]) });
+        if (!::TrySubmitThreadpoolCallback(RunCallback, dispatch.get(), nullptr)) {
+            ready[i] = std::move(dispatch->callback);
+            FinishCallback();
+            return i;
+        }
+        dispatch.release();
+    }
+    return ready.size();
+}
+
+void TimerWheel::FinishCallback() {
+    std::lock_guard<std::mutex> lock(m_lock);
+    --m_inFlight;
+    m_callbacksDone.notify_all();
+}
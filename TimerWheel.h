@@ -0,0 +1,107 @@
+#ifndef TIMER_WHEEL_H_
+#define TIMER_WHEEL_H_
+
+#include <windows.h>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Hierarchical timer wheel used for the periodic work of a service.
+// Schedule() and Cancel() are O(1). Time is advanced by a single driver
+// thread which hands expired callbacks to the system thread pool; it never
+// runs them itself.
+class TimerWheel {
+public:
+    typedef unsigned long long TimerId;
+    typedef std::function<void()> Callback;
+
+    static const TimerId kInvalidTimer = 0;
+
+    explicit TimerWheel(DWORD tickMs = 10);
+    ~TimerWheel();
+
+    TimerWheel(const TimerWheel& other) = delete;
+    TimerWheel& operator=(const TimerWheel& other) = delete;
+
+    // Runs |callback| after |delayMs|, then every |periodMs| when non zero.
+    // Returns kInvalidTimer while Stop() is running.
+    TimerId Schedule(DWORD delayMs, Callback callback, DWORD periodMs = 0);
+
+    // Returns false if the timer has already fired or was cancelled.
+    bool Cancel(TimerId id);
+
+    // While suspended time doesn't advance, so pending timers keep the
+    // remaining part of their delay.
+    void Suspend();
+    void Resume();
+
+    // Cancels all timers, stops the driver thread and waits for callbacks
+    // that are still running. Timers may be scheduled again afterwards.
+    void Stop();
+
+    size_t Size() const;
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    static const uint32_t kNil = 0xFFFFFFFF;
+
+    struct Node {
+        Callback callback;
+        uint64_t expires = 0;
+        uint64_t periodTicks = 0;
+        uint32_t prev = kNil;
+        uint32_t next = kNil;
+        uint32_t slot = kNil;
+        uint32_t generation = 1;
+    };
+
+    struct Dispatch {
+        TimerWheel* wheel;
+        Callback callback;
+    };
+
+    static void CALLBACK RunCallback(PTP_CALLBACK_INSTANCE instance, void* context);
+
+    void DriverLoop();
+    uint64_t CurrentTick() const;
+    uint64_t ToTicks(DWORD ms) const;
+
+    uint32_t AllocNode();
+    void FreeNode(uint32_t index);
+    void Link(uint32_t index);
+    void Unlink(uint32_t index);
+    uint32_t Cascade(uint32_t level, uint32_t index);
+    void Advance();
+    size_t DispatchReady(std::vector<Callback>& ready);
+    void FinishCallback();
+
+    const std::chrono::milliseconds m_tick;
+
+    mutable std::mutex m_lock;
+    std::condition_variable m_wakeup;
+    std::condition_variable m_callbacksDone;
+
+    std::vector<Node> m_nodes;
+    std::vector<uint32_t> m_slots;
+    std::vector<Callback> m_ready;
+    uint32_t m_freeList = kNil;
+    size_t m_count = 0;
+
+    // Next tick to process and the point in time tick zero corresponds to.
+    uint64_t m_now = 0;
+    Clock::time_point m_origin;
+    Clock::time_point m_suspendedAt;
+
+    bool m_suspended = false;
+    bool m_quit = false;
+    long m_inFlight = 0;
+
+    std::thread m_driver;
+};
+
+#endif // TIMER_WHEEL_H_